@@ -0,0 +1,52 @@
+#ifndef __CO_ARCH_H__
+#define __CO_ARCH_H__
+
+// 库内部各文件共用的声明和栈操作, 不对外公开
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 协程栈池 (stack.c): 按线程后进先出复用, 线程之间通过全局仓库整批交换
+__attribute__((visibility("hidden"))) void *co_stack_get(size_t size);
+__attribute__((visibility("hidden"))) void co_stack_put(void *stack, size_t size);
+
+// 名字驻留 (intern.c): 一次查找同时得到编号和驻留的副本
+__attribute__((visibility("hidden"))) uint32_t co_intern_name(const char *name, const char **interned);
+
+static inline uintptr_t get_stack_pointer(void)
+{
+    uintptr_t sp;
+#if __x86_64__
+    asm volatile("movq %%rsp, %0" : "=r"(sp));
+#else
+    asm volatile("movl %%esp, %0" : "=r"(sp));
+#endif
+    return sp;
+}
+
+static inline void set_stack_pointer(void *sp)
+{
+#if __x86_64__
+    asm volatile("movq %0, %%rsp" : : "b"((uintptr_t)sp) : "memory");
+#else
+    asm volatile("movl %0, %%esp" : : "b"((uintptr_t)sp) : "memory");
+#endif
+}
+
+// 切换到新栈并调用 entry(arg), 不会返回: 协程结束时在自己的栈上调度到别的协程
+static inline void stack_switch_call(void *sp, void *entry, uintptr_t arg)
+{
+    asm volatile(
+#if __x86_64__
+        "movq %0, %%rsp; movq %2, %%rdi; call *%1"
+        : : "b"((uintptr_t)sp), "d"(entry), "a"(arg) : "memory"
+#else
+        // ??? why previous 4(%0)?
+        "movl %0, %%esp; movl %2, (%0); call *%1"
+        : : "b"((uintptr_t)sp - 8), "d"(entry), "a"(arg) : "memory"
+#endif
+    );
+    __builtin_unreachable();
+}
+
+#endif
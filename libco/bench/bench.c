@@ -0,0 +1,390 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <co.h>
+
+// 每个基准跑 n 次操作, 输出每次操作的平均耗时
+static void bench(const char *name, void (*fn)(int n), int n)
+{
+    fn(n / 10); // 预热
+    uint64_t start = co_now();
+    fn(n);
+    uint64_t ns = co_now() - start;
+    printf("%-24s %10d ops %10.1f ns/op\n", name, n, (double)ns / n);
+}
+
+// -----------------------------------------------
+
+static void nop(void *arg)
+{
+}
+
+// 创建一个协程并立即等待它结束
+static void spawn_join(int n)
+{
+    for (int i = 0; i < n; ++i)
+        co_wait(co_start("nop", nop, NULL));
+}
+
+// -----------------------------------------------
+
+static void fork_join_tree(void *arg)
+{
+    int depth = (int)(intptr_t)arg;
+    if (depth == 0)
+        return;
+    struct co *left = co_start("tree", fork_join_tree, (void *)(intptr_t)(depth - 1));
+    struct co *right = co_start("tree", fork_join_tree, (void *)(intptr_t)(depth - 1));
+    co_wait(left);
+    co_wait(right);
+}
+
+// 深度为 6 的二叉 fork/join 树, 每次操作是一个节点
+static void fork_join(int n)
+{
+    for (int i = 0; i < n / 127; ++i)
+        fork_join_tree((void *)(intptr_t)6);
+}
+
+// 同上, 但创建者 co_wait 时直接内联执行子协程
+static void fork_join_inline(int n)
+{
+    co_sched_set_inline(co_sched_self(), 1);
+    fork_join(n);
+    co_sched_set_inline(co_sched_self(), 0);
+}
+
+// -----------------------------------------------
+
+// 用掉几页栈, 像真实的协程那样
+static void touch_stack(void *arg)
+{
+    volatile char buf[8192];
+    for (int i = 0; i < (int)sizeof(buf); i += 64)
+        buf[i] = (char)i;
+}
+
+// 一次创建 64 个协程再全部等待, 反复创建和退出, 每次操作是一个协程
+static void spawn_churn(int n)
+{
+    struct co *cos[64];
+    for (int i = 0; i < n / 64; ++i) {
+        for (int j = 0; j < 64; ++j)
+            cos[j] = co_start("churn", touch_stack, NULL);
+        co_wait_all(cos, 64);
+    }
+}
+
+// -----------------------------------------------
+// 两个协程各循环 n / 2 次, 每次迭代 co_yield 或 co_maybe_yield
+
+static void yield_loop(void *arg)
+{
+    for (int i = (int)(intptr_t)arg; i > 0; --i)
+        co_yield ();
+}
+
+static void maybe_yield_loop(void *arg)
+{
+    for (int i = (int)(intptr_t)arg; i > 0; --i)
+        co_maybe_yield();
+}
+
+static void loop_pair(void (*fn)(void *), int n)
+{
+    struct co *cos[2] = { co_start("loop", fn, (void *)(intptr_t)(n / 2)),
+                          co_start("loop", fn, (void *)(intptr_t)(n / 2)) };
+    co_wait_all(cos, 2);
+}
+
+// 只有自己可以运行时的 co_yield
+static void yield_alone(int n)
+{
+    for (int i = 0; i < n; ++i)
+        co_yield ();
+}
+
+// 10000 个协程轮流 co_yield, 每次操作是一次切换; 控制块和栈顶大多不在缓存里.
+// 切换前预取下一个协程的 context 和栈顶在这里测过, 看不出收益, 没有采用
+#define MANY 10000
+
+static void many_loop(void *arg)
+{
+    for (int i = (int)(intptr_t)arg; i > 0; --i)
+        co_yield ();
+}
+
+static void yield_many(int n)
+{
+    static struct co *cos[MANY];
+    for (int i = 0; i < MANY; ++i)
+        cos[i] = co_start("many", many_loop, (void *)(intptr_t)(n / MANY));
+    co_wait_all(cos, MANY);
+}
+
+static void yield_every(int n)
+{
+    loop_pair(yield_loop, n);
+}
+
+static void maybe_yield(int n)
+{
+    loop_pair(maybe_yield_loop, n);
+}
+
+// -----------------------------------------------
+// 把 nop 交给 worker 池, 而不是每次创建协程
+
+static void nop_job(void *args)
+{
+}
+
+static void pool_submit(int n)
+{
+    co_workers_t *pool = co_workers_new("worker", 4, 256);
+    for (int i = 0; i < n; ++i)
+        co_workers_submit(pool, nop_job, NULL, 0);
+    co_workers_free(pool);
+}
+
+// -----------------------------------------------
+// 结果就绪后的后续处理: 回调节点与专门创建一个协程去等
+
+static int g_handled;
+
+static void handle_cb(struct co_node *node)
+{
+    g_handled++;
+}
+
+static void handle_co(void *arg)
+{
+    co_future_get(arg);
+    g_handled++;
+}
+
+static void future_then(int n)
+{
+    struct co_future f;
+    struct co_node node;
+    int v = 1;
+    for (int i = 0; i < n; ++i) {
+        co_future_init(&f);
+        co_node_init(&node, handle_cb);
+        co_future_then(&f, &node);
+        co_promise_set(&f, &v, sizeof(v));
+        co_yield ();
+    }
+}
+
+static void future_spawn(int n)
+{
+    struct co_future f;
+    int v = 1;
+    for (int i = 0; i < n; ++i) {
+        co_future_init(&f);
+        struct co *co = co_start("handler", handle_co, &f);
+        co_promise_set(&f, &v, sizeof(v));
+        co_wait(co);
+    }
+}
+
+// -----------------------------------------------
+// 通道吞吐量: 每次操作是一个数据, 逐个收发与每次最多 64 个
+
+static int g_items;
+
+static void chan_sender(void *arg)
+{
+    struct chan *ch = arg;
+    for (int i = 0; i < g_items; ++i)
+        chan_send(ch, NULL);
+    chan_close(ch);
+}
+
+static void chan_one(int n)
+{
+    struct chan *ch = chan_new(64);
+    void *item;
+    g_items = n;
+    struct co *co = co_start("sender", chan_sender, ch);
+    while (chan_recv(ch, &item) == 0)
+        ;
+    co_wait(co);
+    chan_free(ch);
+}
+
+static void chan_sender_n(void *arg)
+{
+    struct chan *ch = arg;
+    void *items[64] = { NULL };
+    for (int i = 0; i < g_items;) {
+        int n = g_items - i < 64 ? g_items - i : 64;
+        i += chan_send_n(ch, items, n);
+    }
+    chan_close(ch);
+}
+
+static void chan_batch(int n)
+{
+    struct chan *ch = chan_new(64);
+    void *items[64];
+    g_items = n;
+    struct co *co = co_start("sender", chan_sender_n, ch);
+    while (chan_recv_n(ch, items, 64) > 0)
+        ;
+    co_wait(co);
+    chan_free(ch);
+}
+
+// -----------------------------------------------
+// 两个阶段的流水线, 每次操作是一个数据; 比较逐个交接与成批交接
+
+static void stage_pass(void *item, struct co_emit *out, void *ctx)
+{
+    co_pipeline_emit(out, item);
+}
+
+static void stage_drop(void *item, struct co_emit *out, void *ctx)
+{
+}
+
+static void pipeline_run(int n, int batch)
+{
+    struct co_pipeline *p = co_pipeline_new(batch, 4);
+    co_pipeline_stage(p, "pass", stage_pass, NULL, 1);
+    co_pipeline_stage(p, "drop", stage_drop, NULL, 1);
+    co_pipeline_start(p);
+    for (int i = 0; i < n; ++i)
+        co_pipeline_push(p, NULL);
+    co_pipeline_finish(p);
+}
+
+static void pipeline_1(int n)
+{
+    pipeline_run(n, 1);
+}
+
+static void pipeline_64(int n)
+{
+    pipeline_run(n, 64);
+}
+
+// -----------------------------------------------
+// fork/join 的加速比: 同样的工作量分别用 1, 2, 4, ... 个 worker 运行
+
+struct pfib_args {
+    int n;
+    long result;
+};
+
+static long fib(int n)
+{
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+static void pfib(void *arg)
+{
+    struct pfib_args *a = arg;
+    if (a->n < 20) {
+        a->result = fib(a->n);
+        return;
+    }
+    struct pfib_args x = { a->n - 1 }, y = { a->n - 2 };
+    co_fork(pfib, &x);
+    pfib(&y);
+    co_sync();
+    a->result = x.result + y.result;
+}
+
+static void run_pfib(int workers)
+{
+    struct pfib_args a = { 36 };
+    co_fj_run(workers, pfib, &a);
+}
+
+struct psort_args {
+    int *a, n;
+};
+
+static int cmp_int(const void *x, const void *y)
+{
+    return (*(const int *)x > *(const int *)y) - (*(const int *)x < *(const int *)y);
+}
+
+static void psort(void *arg)
+{
+    struct psort_args *p = arg;
+    int *a = p->a, n = p->n, i = 0, j = n - 1, pivot = a[n / 2];
+    if (n < 4096) {
+        qsort(a, n, sizeof(int), cmp_int);
+        return;
+    }
+    while (i <= j) {
+        while (a[i] < pivot)
+            i++;
+        while (a[j] > pivot)
+            j--;
+        if (i <= j) {
+            int t = a[i];
+            a[i++] = a[j];
+            a[j--] = t;
+        }
+    }
+    struct psort_args left = { a, j + 1 }, right = { a + i, n - i };
+    co_fork(psort, &left);
+    psort(&right);
+    co_sync();
+}
+
+static void run_psort(int workers)
+{
+    int n = 1 << 22, *a = malloc(n * sizeof(int));
+    for (int i = 0; i < n; ++i)
+        a[i] = (int)((i * 2654435761u) % 1000003);
+    struct psort_args p = { a, n };
+    co_fj_run(workers, psort, &p);
+    free(a);
+}
+
+static void scaling(const char *name, void (*fn)(int workers))
+{
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    double base = 0;
+
+    for (int workers = 1; workers <= cpus; workers *= 2) {
+        uint64_t start = co_now();
+        fn(workers);
+        double ms = (co_now() - start) / 1e6;
+        if (workers == 1)
+            base = ms;
+        printf("%-16s %2d workers %10.1f ms %6.2fx\n", name, workers, ms, base / ms);
+    }
+}
+
+int main()
+{
+    setbuf(stdout, NULL);
+
+    bench("spawn-join", spawn_join, 200000);
+    bench("fork-join", fork_join, 200000);
+    bench("fork-join-inline", fork_join_inline, 200000);
+    bench("spawn-churn-64", spawn_churn, 640000);
+    bench("yield-alone", yield_alone, 10000000);
+    bench("yield", yield_every, 1000000);
+    bench("yield-10k", yield_many, 5000000);
+    bench("maybe-yield", maybe_yield, 10000000);
+    bench("pool-submit", pool_submit, 1000000);
+    bench("future-then", future_then, 1000000);
+    bench("future-spawn", future_spawn, 200000);
+    bench("chan-one", chan_one, 1000000);
+    bench("chan-batch-64", chan_batch, 1000000);
+    bench("pipeline-batch-1", pipeline_1, 1000000);
+    bench("pipeline-batch-64", pipeline_64, 1000000);
+    scaling("fj-fib(36)", run_pfib);
+    scaling("fj-sort(4M)", run_psort);
+
+    return 0;
+}
@@ -0,0 +1,240 @@
+#include "co.h"
+#include <assert.h>
+#include <stdlib.h>
+
+// 环形缓冲区 + 两个等待队列; 有接收者在等时缓冲区必为空, 有发送者在等时必为满
+struct chan {
+    int cap, head, num;
+    int closed;
+    struct co_list senders;   // 元素为 struct chan_op
+    struct co_list receivers;
+    void *buf[];
+};
+
+struct chan *chan_new(int cap)
+{
+    assert(cap >= 0);
+    struct chan *ch = malloc(sizeof(struct chan) + cap * sizeof(void *));
+    if (!ch)
+        return NULL;
+    ch->cap = cap;
+    ch->head = ch->num = 0;
+    ch->closed = 0;
+    co_list_init(&ch->senders);
+    co_list_init(&ch->receivers);
+    return ch;
+}
+
+void chan_free(struct chan *ch)
+{
+    assert(co_list_empty(&ch->senders) && co_list_empty(&ch->receivers));
+    free(ch);
+}
+
+static inline struct chan_op *pop_op(struct co_list *q)
+{
+    if (co_list_empty(q))
+        return NULL;
+    struct chan_op *op = co_list_entry(q->next, struct chan_op, link);
+    co_list_del(&op->link);
+    return op;
+}
+
+static inline void finish_op(struct chan_op *op, int status)
+{
+    op->status = status;
+    co_ready(op->node);
+}
+
+void chan_close(struct chan *ch)
+{
+    struct chan_op *op;
+    ch->closed = 1;
+    while ((op = pop_op(&ch->senders)) != NULL)
+        finish_op(op, -1);
+    while ((op = pop_op(&ch->receivers)) != NULL)
+        finish_op(op, -1);
+}
+
+int chan_send_async(struct chan *ch, struct chan_op *op, void *item, struct co_node *node)
+{
+    struct chan_op *r;
+
+    co_list_init(&op->link);
+    op->item = item;
+    op->node = node;
+    if (ch->closed)
+        return op->status = -1;
+
+    if ((r = pop_op(&ch->receivers)) != NULL) {
+        // 有接收者在等, 直接交给它
+        r->item = item;
+        finish_op(r, 0);
+        return op->status = 0;
+    }
+    if (ch->num < ch->cap) {
+        ch->buf[(ch->head + ch->num++) % ch->cap] = item;
+        return op->status = 0;
+    }
+    co_list_add_tail(&op->link, &ch->senders);
+    return op->status = 1;
+}
+
+int chan_recv_async(struct chan *ch, struct chan_op *op, struct co_node *node)
+{
+    struct chan_op *s;
+
+    co_list_init(&op->link);
+    op->item = NULL;
+    op->node = node;
+
+    if (ch->num > 0) {
+        op->item = ch->buf[ch->head];
+        ch->head = (ch->head + 1) % ch->cap;
+        ch->num--;
+        // 腾出了位置, 把一个等待的发送者的数据放进来
+        if ((s = pop_op(&ch->senders)) != NULL) {
+            ch->buf[(ch->head + ch->num++) % ch->cap] = s->item;
+            finish_op(s, 0);
+        }
+        return op->status = 0;
+    }
+    if ((s = pop_op(&ch->senders)) != NULL) {
+        op->item = s->item;
+        finish_op(s, 0);
+        return op->status = 0;
+    }
+    if (ch->closed)
+        return op->status = -1;
+    co_list_add_tail(&op->link, &ch->receivers);
+    return op->status = 1;
+}
+
+void chan_cancel(struct chan *ch, struct chan_op *op)
+{
+    if (op->status == 1)
+        co_list_del(&op->link);
+}
+
+// 醒来时操作还没完成就是超时了
+static int chan_park(struct chan *ch, struct chan_op *op, struct co_node *node, uint64_t deadline)
+{
+    co_park_until(node, deadline);
+    if (op->status == 1) {
+        chan_cancel(ch, op);
+        return CO_TIMEDOUT;
+    }
+    return op->status;
+}
+
+int chan_send_until(struct chan *ch, void *item, uint64_t deadline)
+{
+    struct co_node node;
+    struct chan_op op;
+    co_node_init(&node, NULL);
+    if (chan_send_async(ch, &op, item, &node) == 1)
+        return chan_park(ch, &op, &node, deadline);
+    return op.status;
+}
+
+int chan_recv_until(struct chan *ch, void **item, uint64_t deadline)
+{
+    struct co_node node;
+    struct chan_op op;
+    co_node_init(&node, NULL);
+    if (chan_recv_async(ch, &op, &node) == 1 && chan_park(ch, &op, &node, deadline) == CO_TIMEDOUT)
+        return CO_TIMEDOUT;
+    if (op.status == 0)
+        *item = op.item;
+    return op.status;
+}
+
+int chan_send(struct chan *ch, void *item)
+{
+    return chan_send_until(ch, item, CO_FOREVER);
+}
+
+int chan_recv(struct chan *ch, void **item)
+{
+    return chan_recv_until(ch, item, CO_FOREVER);
+}
+
+// ----------------------------------------------------------------
+// 成批收发: 先不挂起地尽量多做, 一个也做不了时才像单个收发一样等待第一个,
+// 醒来后再顺带取走此时能做的; 每批最多一次挂起和唤醒
+// ----------------------------------------------------------------
+
+static int chan_put_many(struct chan *ch, void **items, int n)
+{
+    struct chan_op *r;
+    int i = 0;
+
+    if (ch->closed)
+        return 0;
+    // 有接收者在等时缓冲区必为空
+    while (i < n && (r = pop_op(&ch->receivers)) != NULL) {
+        r->item = items[i++];
+        finish_op(r, 0);
+    }
+    while (i < n && ch->num < ch->cap)
+        ch->buf[(ch->head + ch->num++) % ch->cap] = items[i++];
+    return i;
+}
+
+static int chan_take_many(struct chan *ch, void **items, int n)
+{
+    struct chan_op *s;
+    int i = 0;
+
+    while (i < n) {
+        if (ch->num > 0) {
+            items[i++] = ch->buf[ch->head];
+            ch->head = (ch->head + 1) % ch->cap;
+            ch->num--;
+            if ((s = pop_op(&ch->senders)) != NULL) {
+                ch->buf[(ch->head + ch->num++) % ch->cap] = s->item;
+                finish_op(s, 0);
+            }
+        } else if ((s = pop_op(&ch->senders)) != NULL) {
+            items[i++] = s->item;
+            finish_op(s, 0);
+        } else {
+            break;
+        }
+    }
+    return i;
+}
+
+int chan_send_n_until(struct chan *ch, void **items, int n, uint64_t deadline)
+{
+    int done, status;
+
+    if (ch->closed)
+        return -1;
+    if ((done = chan_put_many(ch, items, n)) > 0 || n == 0)
+        return done;
+    if ((status = chan_send_until(ch, items[0], deadline)) < 0)
+        return status;
+    return 1 + chan_put_many(ch, items + 1, n - 1);
+}
+
+int chan_recv_n_until(struct chan *ch, void **items, int n, uint64_t deadline)
+{
+    int done, status;
+
+    if ((done = chan_take_many(ch, items, n)) > 0 || n == 0)
+        return done;
+    if ((status = chan_recv_until(ch, &items[0], deadline)) < 0)
+        return status;
+    return 1 + chan_take_many(ch, items + 1, n - 1);
+}
+
+int chan_send_n(struct chan *ch, void **items, int n)
+{
+    return chan_send_n_until(ch, items, n, CO_FOREVER);
+}
+
+int chan_recv_n(struct chan *ch, void **items, int n)
+{
+    return chan_recv_n_until(ch, items, n, CO_FOREVER);
+}
@@ -1,16 +1,24 @@
 #include "co.h"
+#include "arch.h"
 #include "stdint.h"
 #include "stdio.h"
 #include "unistd.h"
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
 
-#define STACK_SIZE 8192
-#define MAX_CO_NUM 128
+#define STACK_SIZE (64 * 1024) // 无缓冲的 printf 在栈上就要用 BUFSIZ (8KiB)
 #define SWITCH_OUT 0
 #define SWITCH_IN  1
+#define POLL_EVENTS   64
+#define POLL_INTERVAL 64 // 有 I/O 等待时, 每调度这么多次顺带查看一次 epoll
+#define SLICE_NS 100000  // co_maybe_yield: 协程至少连续运行这么久才让出
 // https://unix.stackexchange.com/questions/425013/why-do-i-have-to-set-ld-library-path-before-running-a-program-even-though-i-alr
 
 #ifdef DEBUG
@@ -19,44 +27,6 @@
 #define debug(...)
 #endif
 
-static inline uintptr_t get_stack_pointer(void)
-{
-    uintptr_t sp;
-#if __x86_64__
-    asm volatile("movq %%rsp, %0" : "=r"(sp));
-#else
-    asm volatile("movl %%esp, %0" : "=r"(sp));
-#endif
-    return sp;
-}
-
-static inline void set_stack_pointer(void *sp)
-{
-#if __x86_64__
-    asm volatile("movq %0, %%rsp" : : "b"((uintptr_t)sp) : "memory");
-#else
-    asm volatile("movl %0, %%esp" : : "b"((uintptr_t)sp) : "memory");
-#endif
-}
-
-static uintptr_t prev_sp = 0;
-
-static inline void stack_switch_call(void *sp, void *entry, uintptr_t arg)
-{
-    prev_sp = get_stack_pointer();
-    asm volatile(
-#if __x86_64__
-        "movq %0, %%rsp; movq %2, %%rdi; call *%1"
-        : : "b"((uintptr_t)sp), "d"(entry), "a"(arg) : "memory"
-#else
-        // ??? why previous 4(%0)?
-        "movl %0, %%esp; movl %2, (%0); call *%1"
-        : : "b"((uintptr_t)sp - 8), "d"(entry), "a"(arg) : "memory"
-#endif
-    );
-    set_stack_pointer((void *)prev_sp);
-}
-
 enum co_status {
     CO_NEW = 1, // 新创建，还未执行过
     CO_RUNNING, // 已经执行过
@@ -65,152 +35,1240 @@ enum co_status {
 };
 
 struct co {
-    const char *name;
+    const char *name;     // 驻留的名字, 不再引用调用者的字符串
+    uint64_t id;
+    uint32_t name_id;
     void (*func)(void *); // co_start 指定的入口地址和参数
     void *arg;
+    void (*cleanup)(void *arg); // 没运行过就被 co_sched_destroy 释放时析构参数
 
     enum co_status status;     // 协程的状态
-    struct co *waiter;         // 是否有其他协程在等待当前协程
+    struct co_sched *sched;    // 所属的调度器
+    struct co_list all;        // 在 sched->all 中的位置
+    struct co_list waiters;    // 等待当前协程结束的节点 (co_wait_async)
+    int joiners;               // 正在 co_wait 的协程数 (含 co_wait_any/all), 最后一个返回的负责释放
+    int reaped;                // 已经有 co_wait 返回, 引用都放开时释放
+    struct chan *mailbox;      // co_send/co_recv 用, 第一次用到时才创建
+    struct co_node node;       // co_start/co_yield 时放进就绪队列的节点
+    struct co *post_next;      // 在 sched->posts 中的下一个
+    int posted;                // 已经在 sched->posts 中, 避免重复入队
+    int inlining;              // 1: 正在内联执行它等待的协程, 现场不能用; 2: 其间被 co_post 过
     jmp_buf context;           // 寄存器现场 (setjmp.h)
-    uint8_t stack[STACK_SIZE]; // 协程的堆栈
+    struct co *creator;        // 调用 co_start 的协程, 只有它可以内联执行本协程
+    struct co_group *group;    // 准入限制所在的组
+    int admitted;              // 已经占用了 group 及其祖先的名额
+    struct co_list queue_link; // 还没放行时在已满的那一组的 waiting 中
+    struct co_node *spawner;   // CO_LIMIT_BLOCK: 放行时唤醒挂起的创建者
+    uint8_t *stack_top;        // 栈顶, co_start_with 的参数保存在它之上
+    void *args;                // co_start_with 的协程要排队时, 参数改放在堆上, 排队期间不占栈
+    uint8_t *stack;            // 协程的堆栈, 第一次切换进来时才分配; 宿主协程和内联执行的协程没有
 };
 
-struct co_pool {
-    struct co *co[MAX_CO_NUM];
+struct co_sched {
+    // this must be reached through memory, or setjmp/longjmp will see stale registers
+    struct co *current;
+    struct co *host;            // 调用 co_sched_run 的上下文 (默认调度器为线程本来的栈)
+    struct co_sched *outer;     // co_sched_run 嵌套时外层的调度器
+    struct co_node *drainer;    // 在 co_sched_run 中等待所有协程结束
+    struct co *exiting;         // 已经结束、还在自己的栈上调度的协程
+    uint8_t *release;           // exiting 在此期间被回收时, 它的栈等切换走之后再还回栈池
+
+    struct co_list all;         // 还没有回收的协程 (不含 host)
     int co_num;
-    int poller;
+    int live;                   // 还没有结束的协程数
+
+    struct co_list ready;       // 就绪队列, 元素为 struct co_node
+    struct co_group group;      // 准入限制的根, 默认不限
+    int in_callback;            // 正在执行节点回调, 此时不能挂起
+    int inline_join;            // co_start 不立即让出, 创建者 co_wait 还没开始的协程时直接内联执行
+
+    struct co_timer **timers;   // 定时器最小堆
+    int timer_num, timer_cap;
+
+    int epfd;                   // 懒创建
+    int efd;                    // eventfd, 别的线程 co_post 后用它叫醒 epoll_wait
+    int io_num;                 // 正在等待的 fd 数
+    struct co *posts;           // 别的线程 co_post 进来的协程, 无锁栈
+    unsigned ticks;
+    uint64_t slice_start;       // co_maybe_yield: 本次运行第一次检查预算的时间, 0 表示还没检查
+
+    struct co_sched_stats stats;
 };
 
-// this must be static, or line 186 will access it using local registers, weird!
-static struct co *current;
-struct co_pool co_pool;
+// 本线程正在运行的调度器; 第一次用到时才创建默认调度器
+static __thread struct co_sched *sched;
+static uint64_t last_id;
+__thread int co_budget = CO_YIELD_BUDGET;
+
+static struct co_sched *sched_default(void);
 
-static inline int manage_co(struct co *co)
+static inline struct co_sched *sched_self(void)
 {
-    for (int i = 0; i < MAX_CO_NUM; ++i) {
-        if (co_pool.co[i] == NULL) {
-            co_pool.co[i] = co;
-            co_pool.co_num++;
-            return 0;
-        }
-    }
-    return -1;
+    return sched ? sched : sched_default();
 }
 
-static inline int unmanage_co(struct co *co)
+static void co_schedule(struct co_sched *s);
+static void co_switch(struct co_sched *s, struct co *next);
+static void co_landed(struct co_sched *s);
+static void co_finish(struct co_sched *s, struct co *co);
+static struct co_node *co_wake_waiters(struct co *co);
+static void group_release(struct co *co);
+
+// 协程入口: 以前在 stack_switch_call 返回后回到 prev_sp 继续调度, 但那块栈可能
+// 已经被 co_wait 释放; 现在直接在协程自己的栈上标记结束并切走, 永不返回
+static void co_entry(struct co *co)
 {
-    for (int i = 0; i < MAX_CO_NUM; ++i) {
-        if (co_pool.co[i] == co) {
-            co_pool.co[i] = NULL;
-            co_pool.co_num--;
-            return 0;
-        }
+    struct co_sched *s = co->sched;
+
+    co_landed(s);
+    co->func(co->arg);
+    co_finish(s, co);
+
+    // 第一个是同一调度器中的协程时直接切换过去, 不用等就绪队列轮一圈
+    struct co_node *first = co_wake_waiters(co);
+    if (first && first->fn == NULL && first->co->sched == s) {
+        co_list_del(&first->link);
+        co_switch(s, first->co);
     }
-    return -1;
+    // 就绪队列里的回调 (比如 C++ 的 co::join) 可能在这块栈上回收本协程
+    s->exiting = co;
+    co_schedule(s);
+    assert(0);
 }
 
-void co_yield (void);
-
-struct co *co_start(const char *name, void (*func)(void *), void *arg)
+static struct co *co_create(struct co_sched *s, const char *name, void (*func)(void *), void *arg)
 {
     struct co *co = malloc(sizeof(struct co));
     if (!co)
         return NULL;
 
-    co->name = name;
+    co->name_id = co_intern_name(name, &co->name);
+    co->id = __atomic_add_fetch(&last_id, 1, __ATOMIC_RELAXED);
     co->func = func;
     co->arg = arg;
+    co->cleanup = NULL;
 
     co->status = func == NULL ? CO_RUNNING : CO_NEW;
-    co->waiter = NULL;
+    co->sched = s;
+    co->creator = s->current;
+    co->group = NULL;
+    co->admitted = 0;
+    co_list_init(&co->queue_link);
+    co->spawner = NULL;
+    co->stack = co->stack_top = NULL;
+    co->args = NULL;
+    co_list_init(&co->all);
+    co_list_init(&co->waiters);
+    co->joiners = 0;
+    co->reaped = 0;
+    co->mailbox = NULL;
+    co->post_next = NULL;
+    co->posted = 0;
+    co->inlining = 0;
+    co_list_init(&co->node.link);
+    co->node.fn = NULL;
+    co->node.co = co;
 
-    memset(co->stack, 0, STACK_SIZE);
-
-    manage_co(co);
+    if (func != NULL) {
+        co_list_add_tail(&co->all, &s->all);
+        s->co_num++;
+        s->live++;
+        s->stats.spawned++;
+    }
 
     debug("co '%s' initialized, scheduling\n", co->name == NULL ? "main" : co->name);
+    return co;
+}
 
-    if (func != NULL)
-        co_yield ();
+static void co_free(struct co *co)
+{
+    if (co->func != NULL) {
+        co_list_del(&co->all);
+        co->sched->co_num--;
+    }
+    if (co->mailbox)
+        chan_free(co->mailbox);
+    co_list_del(&co->queue_link);
+    free(co->args);
+    if (co == co->sched->exiting) {
+        // 调度器还在这块栈上, 而且不能再把已经释放的 co 当作当前协程
+        co->sched->exiting = co->sched->current = NULL;
+        co->sched->release = co->stack;
+    } else {
+        co_stack_put(co->stack, STACK_SIZE);
+    }
+    free(co);
+}
+
+// 唤醒全部等待者, 返回第一个 (已放进就绪队列), 没有则返回 NULL
+static struct co_node *co_wake_waiters(struct co *co)
+{
+    struct co_node *first = NULL;
+    while (!co_list_empty(&co->waiters)) {
+        struct co_node *node = co_list_entry(co->waiters.next, struct co_node, link);
+        if (!first)
+            first = node;
+        co_ready(node); // 同时从 waiters 中摘下
+    }
+    return first;
+}
+
+// 以前 co_start 时就分配并清零整个栈; 现在推迟到第一次切换进来, 也不再清零.
+// 栈从本线程的栈池取, 优先复用最近释放的那个, 其栈顶还在缓存里
+static int co_stack_alloc(struct co *co)
+{
+    co->stack = co_stack_get(STACK_SIZE);
+    if (!co->stack)
+        return -1;
+    co->stack_top = co->stack + STACK_SIZE;
+    return 0;
+}
 
+// 协程结束 (函数已经返回) 后的记账
+static void co_finish(struct co_sched *s, struct co *co)
+{
+    co->status = CO_DEAD;
+    if (co->admitted)
+        group_release(co);
+    if (co->mailbox)
+        chan_close(co->mailbox); // 还在等着发送的协程得到 -1
+    if (--s->live == 0 && s->drainer) {
+        co_ready(s->drainer);
+        s->drainer = NULL;
+    }
+}
+
+// ----------------------------------------------------------------
+// 准入控制: 每个协程属于一个组, 组可以有父组 (最终都是调度器的根组);
+// 协程要在自己的组和全部祖先中都有名额才放行, 否则按组的策略失败、阻塞创建者或排队.
+// 排队的协程只有 struct co, 栈在第一次运行时才分配, 所以排队几乎不占内存
+// ----------------------------------------------------------------
+
+// 从 g 往上第一个已满的组, 都有名额则返回 NULL
+static struct co_group *group_full(struct co_group *g)
+{
+    for (; g; g = g->parent)
+        if (g->max > 0 && g->live >= g->max)
+            return g;
+    return NULL;
+}
+
+// 放行或者在已满的那一组排队, 放行返回 1
+static int group_admit(struct co *co)
+{
+    struct co_group *full = group_full(co->group);
+    if (full) {
+        co_list_add_tail(&co->queue_link, &full->waiting);
+        return 0;
+    }
+    for (struct co_group *g = co->group; g; g = g->parent)
+        g->live++;
+    co->admitted = 1;
+    co_ready(&co->node);
+    if (co->spawner) {
+        co_ready(co->spawner);
+        co->spawner = NULL;
+    }
+    return 1;
+}
+
+static void group_release(struct co *co)
+{
+    struct co_group *g;
+
+    co->admitted = 0;
+    for (g = co->group; g; g = g->parent)
+        g->live--;
+    // 每一层都可能腾出了名额; 等待者可能又卡在别的组, 那就换到那一组排队
+    for (g = co->group; g; g = g->parent) {
+        while (!co_list_empty(&g->waiting)) {
+            struct co *next = co_list_entry(g->waiting.next, struct co, queue_link);
+            if (group_full(next->group) == g)
+                break;
+            co_list_del(&next->queue_link);
+            group_admit(next);
+        }
+    }
+}
+
+void co_group_init(struct co_group *g, struct co_group *parent, int max, int policy)
+{
+    g->sched = parent ? parent->sched : sched_self();
+    g->parent = parent ? parent : &g->sched->group;
+    g->max = max;
+    g->live = 0;
+    g->policy = policy;
+    co_list_init(&g->waiting);
+}
+
+void co_sched_set_limit(co_sched_t *s, int max, int policy)
+{
+    s->group.max = max;
+    s->group.policy = policy;
+}
+
+co_group_t *co_sched_group(co_sched_t *s)
+{
+    return &s->group;
+}
+
+static int group_reject(struct co_group *g)
+{
+    if (g->policy == CO_LIMIT_FAIL && group_full(g)) {
+        errno = EAGAIN;
+        return 1;
+    }
+    return 0;
+}
+
+// 刚创建的协程: 有名额就放行并启动, 否则排队, CO_LIMIT_BLOCK 时还要等到放行
+static struct co *co_launch_in(struct co_group *g, struct co *co)
+{
+    struct co_sched *s = co->sched;
+
+    co->group = g;
+    if (group_admit(co)) {
+        if (s == sched && !s->inline_join)
+            co_yield ();
+    } else if (g->policy == CO_LIMIT_BLOCK && s == sched && !s->in_callback) {
+        struct co_node node;
+        co_node_init(&node, NULL);
+        co->spawner = &node;
+        // 别的唤醒 (比如 co_post) 不算数; 放行时 group_admit 清掉 spawner 再唤醒.
+        // 不能看 admitted: co 放行后可能在创建者恢复之前就已经结束了
+        while (co->spawner)
+            co_park();
+        co->spawner = NULL; // 已经是 NULL, 写出来让 -Wdangling-pointer 知道 node 的地址没有留在 co 里
+    }
     return co;
 }
 
-void co_wait(struct co *co)
+struct co *co_group_start(co_group_t *g, const char *name, void (*func)(void *), void *arg)
 {
+    if (func == NULL || group_reject(g))
+        return NULL;
+    struct co *co = co_create(g->sched, name, func, arg);
+    return co ? co_launch_in(g, co) : NULL;
+}
+
+struct co *co_sched_start(co_sched_t *s, const char *name, void (*func)(void *), void *arg)
+{
+    return co_group_start(&s->group, name, func, arg);
+}
+
+struct co *co_start(const char *name, void (*func)(void *), void *arg)
+{
+    return co_sched_start(sched_self(), name, func, arg);
+}
+
+struct co *co_start_with(const char *name, void (*func)(void *), size_t size,
+                         void (*init)(void *buf, void *ctx), void *ctx)
+{
+    size_t reserved = (size + 0xF) & ~(size_t)0xF;
+    struct co_sched *s = sched_self();
+    if (reserved > CO_ARGS_MAX || func == NULL || group_reject(&s->group))
+        return NULL;
+
+    struct co *co = co_create(s, name, func, NULL);
+    if (!co)
+        return NULL;
+    if (group_full(&s->group)) {
+        // 要排队: 栈等放行后第一次运行时才分配, 参数只好放在堆上, 之后也不再搬动
+        co->arg = co->args = malloc(reserved ? reserved : 1);
+        if (!co->args) {
+            co_free(co);
+            return NULL;
+        }
+    } else {
+        if (co_stack_alloc(co) < 0) {
+            co_free(co);
+            return NULL;
+        }
+        // 参数放在栈顶, 协程的栈从参数下方开始
+        co->stack_top -= reserved;
+        co->arg = co->stack_top;
+    }
+    // 必须在第一次调度前构造好
+    if (init)
+        init(co->arg, ctx);
+    else
+        memcpy(co->arg, ctx, size);
+
+    return co_launch_in(&s->group, co);
+}
+
+// 在调用者的栈上直接运行还没开始的 co, 省掉分配栈和两次切换;
+// co 中途挂起时保存的现场也在调用者的栈上, 而调用者本来就在等它, 不会用到这段栈
+static void co_run_inline(struct co_sched *s, struct co *co)
+{
+    struct co *caller = s->current;
+
+    co_list_del(&co->node.link);
+    caller->status = CO_WAITING;
+    caller->inlining = 1;
+    co->status = CO_RUNNING;
+    s->current = co;
+    s->stats.inlined++;
+
+    co->func(co->arg);
+
+    assert(s->current == co);
+    s->current = caller;
+    caller->status = CO_RUNNING;
+    // 内联期间的 co_post 推迟到现在, 调用者的现场重新可用了; 唤醒留给它之后的 co_park
+    if (caller->inlining == 2) {
+        __atomic_store_n(&caller->posted, 0, __ATOMIC_RELEASE);
+        co_ready(&caller->node);
+    }
+    caller->inlining = 0;
+    co_finish(s, co);
+    co_wake_waiters(co);
+}
+
+// 放开一个 joiners 引用; reap 表示这是一次返回了的 co_wait, 此后 co 可以被回收
+static void co_unjoin(struct co *co, int reap)
+{
+    if (reap)
+        co->reaped = 1;
+    if (--co->joiners == 0 && co->reaped)
+        co_free(co);
+}
+
+int co_wait_until(struct co *co, uint64_t deadline)
+{
+    struct co_sched *s = sched_self();
+    struct co *current = s->current;
+
     debug("co '%s' waiting for co '%s'\n", current->name, co->name);
-    current->status = CO_WAITING;
-    co->waiter = current;
-    while (co->status != CO_DEAD)
-        co_yield ();
-    unmanage_co(co);
-    free(co);
+    if (co->status == CO_NEW && co->admitted && s->inline_join && co->sched == s && co->creator == current &&
+        co_list_empty(&co->waiters) && co->joiners == 0 && !s->in_callback && deadline == CO_FOREVER)
+        co_run_inline(s, co);
+
+    co->joiners++;
+    if (co->status != CO_DEAD) {
+        struct co_node node;
+        co_node_init(&node, NULL);
+        co_list_add_tail(&node.link, &co->waiters);
+        current->status = CO_WAITING;
+        co_park_until(&node, deadline);
+        current->status = CO_RUNNING;
+        if (co->status != CO_DEAD) {
+            co_list_del(&node.link);
+            co->joiners--;
+            return CO_TIMEDOUT;
+        }
+    }
     debug("wait '%s' over, '%s' resumed\n", co->name, current->name);
+    co_unjoin(co, 1);
+    return 0;
+}
+
+int co_wait_timeout(struct co *co, uint64_t ns)
+{
+    return co_wait_until(co, co_now() + ns);
+}
+
+void co_wait(struct co *co)
+{
+    co_wait_until(co, CO_FOREVER);
+}
+
+int co_wait_async(struct co *co, struct co_node *node)
+{
+    if (co->status == CO_DEAD)
+        return 0;
+    co_list_add_tail(&node->link, &co->waiters);
+    return 1;
+}
+
+// co_wait_any/co_wait_all 在每个目标上挂一个回调节点, 都指向同一个 wait_group
+struct wait_group {
+    struct co_node wake; // 调用者自己的节点
+    int remaining;       // 还要等几个目标结束才唤醒调用者
+    int fired;           // 第一个结束的目标的下标
+};
+
+struct wait_slot {
+    struct co_node node;
+    struct wait_group *group;
+    int idx;
+};
+
+static void wait_slot_fire(struct co_node *node)
+{
+    struct wait_slot *slot = co_list_entry(node, struct wait_slot, node);
+    struct wait_group *g = slot->group;
+    if (g->fired < 0)
+        g->fired = slot->idx;
+    if (--g->remaining == 0)
+        co_ready(&g->wake);
+}
+
+// 等到 cos 中有 need 个结束为止; 节点数组不多时放在栈上
+#define WAIT_SLOTS_INLINE 16
+
+// 调用者挂起期间算作每个目标的 joiner, 免得别的协程 co_wait 返回时把目标回收掉;
+// 返回后由调用者 co_unjoin. 内存不足时不占用引用, 返回 -1
+static int co_wait_group(struct co **cos, int n, int need)
+{
+    struct wait_slot inline_slots[WAIT_SLOTS_INLINE], *slots = inline_slots;
+    struct wait_group g;
+    struct co *current = sched_self()->current;
+    int pending = 0;
+
+    g.fired = -1;
+    for (int i = 0; i < n; ++i) {
+        cos[i]->joiners++;
+        if (cos[i]->status == CO_DEAD) {
+            if (g.fired < 0)
+                g.fired = i;
+            need--;
+        }
+    }
+    if (need <= 0)
+        return g.fired;
+
+    if (n > WAIT_SLOTS_INLINE && !(slots = malloc(n * sizeof(*slots)))) {
+        for (int i = 0; i < n; ++i)
+            cos[i]->joiners--;
+        return -1;
+    }
+    co_node_init(&g.wake, NULL);
+    g.remaining = need;
+    for (int i = 0; i < n; ++i) {
+        co_node_init(&slots[i].node, wait_slot_fire);
+        slots[i].group = &g;
+        slots[i].idx = i;
+        pending += co_wait_async(cos[i], &slots[i].node);
+    }
+    assert(pending >= need);
+
+    current->status = CO_WAITING;
+    co_park();
+    current->status = CO_RUNNING;
+
+    // 其余节点可能还挂在目标上, 也可能已经在就绪队列中等着回调
+    for (int i = 0; i < n; ++i)
+        co_list_del(&slots[i].node.link);
+    if (slots != inline_slots)
+        free(slots);
+    return g.fired;
+}
+
+int co_wait_any(struct co **cos, int n)
+{
+    assert(n > 0);
+    int fired = co_wait_group(cos, n, 1);
+    if (fired < 0)
+        return -1;
+    // 只回收结束的那个; 其余的如果已经被别人 co_wait 过, 这里是最后一个引用
+    for (int i = 0; i < n; ++i)
+        co_unjoin(cos[i], i == fired);
+    return fired;
+}
+
+int co_wait_all(struct co **cos, int n)
+{
+    if (co_wait_group(cos, n, n) < 0 && n > 0)
+        return -1;
+    for (int i = 0; i < n; ++i)
+        co_unjoin(cos[i], 1);
+    return 0;
+}
+
+// ----------------------------------------------------------------
+// 信箱: 每个协程一个有界的通道, 收发都复用 chan 的环形缓冲区和直接交接
+// ----------------------------------------------------------------
+
+int co_mailbox_open(struct co *co, int cap)
+{
+    assert(cap > 0);
+    if (co->mailbox)
+        return 0;
+    co->mailbox = chan_new(cap);
+    if (!co->mailbox)
+        return -1;
+    // 已经结束的协程不再收信
+    if (co->status == CO_DEAD)
+        chan_close(co->mailbox);
+    return 0;
+}
+
+int co_send_until(struct co *co, void *msg, uint64_t deadline)
+{
+    if (co_mailbox_open(co, CO_MAILBOX_CAP) < 0)
+        return -1;
+    return chan_send_until(co->mailbox, msg, deadline);
+}
+
+int co_send(struct co *co, void *msg)
+{
+    return co_send_until(co, msg, CO_FOREVER);
+}
+
+int co_recv_until(void **msg, uint64_t deadline)
+{
+    struct co *current = sched_self()->current;
+    if (co_mailbox_open(current, CO_MAILBOX_CAP) < 0)
+        return -1;
+    return chan_recv_until(current->mailbox, msg, deadline);
+}
+
+int co_recv(void **msg)
+{
+    return co_recv_until(msg, CO_FOREVER);
+}
+
+void co_set_cleanup(struct co *co, void (*cleanup)(void *arg))
+{
+    co->cleanup = cleanup;
+}
+
+uint64_t co_id(struct co *co)
+{
+    return co->id;
+}
+
+uint32_t co_name_id(struct co *co)
+{
+    return co->name_id;
+}
+
+struct co *co_self(void)
+{
+    return sched_self()->current;
+}
+
+void co_node_init(struct co_node *node, void (*fn)(struct co_node *))
+{
+    co_list_init(&node->link);
+    node->fn = fn;
+    node->co = fn == NULL ? sched_self()->current : NULL;
+}
+
+void co_ready(struct co_node *node)
+{
+    // 协程回到它自己的调度器; 回调在当前的调度器中执行
+    struct co_sched *s = node->co ? node->co->sched : sched_self();
+
+    // 已经在就绪队列中的节点 (比如先被唤醒又超时) 只保留一份
+    co_list_del(&node->link);
+    co_list_add_tail(&node->link, &s->ready);
+}
+
+// 没有跨线程唤醒、到期的定时器或该查看的 I/O, 调度时不会有新的协程就绪.
+// 只看不改: 跳过调度的快速路径自己用 co_sched_skip 推进 ticks, 每次让出只推进一次,
+// 轮到查看 I/O 的那一次一定走 co_schedule
+static int co_sched_quiet(struct co_sched *s)
+{
+    if (__atomic_load_n(&s->posts, __ATOMIC_RELAXED))
+        return 0;
+    if (s->io_num > 0 && (s->ticks + 1) % POLL_INTERVAL == 0)
+        return 0;
+    if (s->timer_num > 0 && s->timers[0]->deadline <= co_now())
+        return 0;
+    return 1;
+}
+
+// 快速路径代替了一次调度, 同样计一次数
+static inline void co_sched_skip(struct co_sched *s)
+{
+    if (s->io_num > 0)
+        s->ticks++;
+}
+
+// 就绪队列里只有当前协程自己的一个节点: 调度下去选中的还是自己
+static int co_park_alone(struct co_sched *s)
+{
+    struct co_list *first = s->ready.next;
+    if (first == &s->ready || first->next != &s->ready)
+        return 0;
+    struct co_node *node = co_list_entry(first, struct co_node, link);
+    if (node->fn || node->co != s->current || !co_sched_quiet(s))
+        return 0;
+    co_list_del(first);
+    co_sched_skip(s);
+    return 1;
 }
 
 void co_yield (void)
 {
-    int val = setjmp(current->context);
-    struct co *next = NULL;
+    struct co_sched *s = sched_self();
+
+    // 在回调中 (比如 C++20 协程里 co_start) 不能切换, 新协程已经在就绪队列里了
+    if (s->in_callback)
+        return;
+    // 只有自己可以运行: 连就绪队列也不用进
+    if (co_list_empty(&s->ready) && co_sched_quiet(s)) {
+        co_sched_skip(s);
+        return;
+    }
+    co_ready(&s->current->node);
+    co_park();
+}
+
+// 预算用完: 运行够了一个时间片, 而且确实有别的事可做才让出, 否则再给一份预算
+void co_maybe_yield_slow(void)
+{
+    struct co_sched *s = sched_self();
+    uint64_t now = co_now();
+
+    co_budget = CO_YIELD_BUDGET;
+    if (s->slice_start == 0)
+        s->slice_start = now;
+    if (now - s->slice_start < SLICE_NS)
+        return;
+    if (!co_list_empty(&s->ready) || __atomic_load_n(&s->posts, __ATOMIC_RELAXED) || s->io_num > 0 ||
+        (s->timer_num > 0 && s->timers[0]->deadline <= now)) {
+        co_yield ();
+        return;
+    }
+    s->slice_start = now;
+}
+
+void co_park(void)
+{
+    struct co_sched *s = sched_self();
+
+    assert(!s->in_callback);
+    // 快速路径: 不用 setjmp 保存现场再 longjmp 回到自己
+    if (co_park_alone(s))
+        return;
+    int val = setjmp(s->current->context);
     if (val == SWITCH_OUT) {
         /* save context using setjmp */
-        for (int i = co_pool.poller; i < MAX_CO_NUM; i++) {
-            if (co_pool.co[i] != NULL && co_pool.co[i]->status != CO_DEAD) {
-                next = co_pool.co[i];
-                co_pool.poller = (i + 1) % MAX_CO_NUM;
-                break;
-            }
-        }
+        co_schedule(sched);
+    } else {
+        debug("switch back to co %s\n", sched->current->name);
+        co_landed(sched);
+    }
+}
+
+// ----------------------------------------------------------------
+// 定时器: 以 deadline 为键的二叉最小堆
+// ----------------------------------------------------------------
+
+uint64_t co_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void timer_set(struct co_sched *s, int i, struct co_timer *t)
+{
+    s->timers[i] = t;
+    t->idx = i;
+}
 
-        if (!next) {
-            for (int i = 0; i < co_pool.poller; i++) {
-                if (co_pool.co[i] != NULL && co_pool.co[i]->status != CO_DEAD) {
-                    next = co_pool.co[i];
-                    co_pool.poller = (i + 1) % MAX_CO_NUM;
-                    break;
-                }
-            }
+static void timer_sift(struct co_sched *s, int i)
+{
+    struct co_timer **h = s->timers, *t = h[i];
+    int n = s->timer_num;
+
+    while (i > 0 && h[(i - 1) / 2]->deadline > t->deadline) {
+        timer_set(s, i, h[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= n)
+            break;
+        if (c + 1 < n && h[c + 1]->deadline < h[c]->deadline)
+            c++;
+        if (h[c]->deadline >= t->deadline)
+            break;
+        timer_set(s, i, h[c]);
+        i = c;
+    }
+    timer_set(s, i, t);
+}
+
+void co_timer_init(struct co_timer *t)
+{
+    t->deadline = 0;
+    t->node = NULL;
+    t->idx = -1;
+    t->sched = NULL;
+}
+
+void co_timer_start(struct co_timer *t, uint64_t deadline, struct co_node *node)
+{
+    struct co_sched *s = sched_self();
+
+    co_timer_cancel(t);
+    if (s->timer_num == s->timer_cap) {
+        int cap = s->timer_cap ? s->timer_cap * 2 : 16;
+        struct co_timer **h = realloc(s->timers, cap * sizeof(*h));
+        assert(h != NULL);
+        s->timers = h;
+        s->timer_cap = cap;
+    }
+    t->deadline = deadline;
+    t->node = node;
+    t->sched = s;
+    timer_set(s, s->timer_num++, t);
+    timer_sift(s, t->idx);
+}
+
+// 在启动它的调度器的堆里删除, 当前调度器可能是嵌套的另一个
+void co_timer_cancel(struct co_timer *t)
+{
+    struct co_sched *s = t->sched;
+    int i = t->idx;
+
+    if (i < 0)
+        return;
+    t->idx = -1;
+    struct co_timer *last = s->timers[--s->timer_num];
+    if (last != t) {
+        timer_set(s, i, last);
+        timer_sift(s, i);
+    }
+}
+
+int co_park_until(struct co_node *node, uint64_t deadline)
+{
+    struct co_timer timer;
+
+    if (deadline == CO_FOREVER) {
+        co_park();
+        return 0;
+    }
+    co_timer_init(&timer);
+    co_timer_start(&timer, deadline, node);
+    co_park();
+    // 到期的定时器已经被 timer_expire 移出堆
+    if (timer.idx < 0)
+        return CO_TIMEDOUT;
+    co_timer_cancel(&timer);
+    return 0;
+}
+
+void co_sleep_until(uint64_t deadline)
+{
+    struct co_node node;
+    co_node_init(&node, NULL);
+    while (co_park_until(&node, deadline) != CO_TIMEDOUT)
+        ; // 被别人提前 co_ready 也要睡够
+}
+
+void co_sleep(uint64_t ns)
+{
+    co_sleep_until(co_now() + ns);
+}
+
+static void timer_expire(struct co_sched *s, uint64_t now)
+{
+    while (s->timer_num > 0 && s->timers[0]->deadline <= now) {
+        struct co_timer *t = s->timers[0];
+        co_timer_cancel(t);
+        co_ready(t->node);
+    }
+}
+
+// ----------------------------------------------------------------
+// I/O: 每个等待的 fd 以 EPOLLONESHOT 注册一次, 就绪后注销
+// ----------------------------------------------------------------
+
+static int epoll_fd(struct co_sched *s)
+{
+    if (s->epfd < 0) {
+        // data.ptr 为 NULL 的事件来自 eventfd
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        s->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (s->epfd >= 0)
+            epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->efd, &ev);
+    }
+    return s->epfd;
+}
+
+int co_io_start(struct co_io *io, int fd, int events, struct co_node *node)
+{
+    struct co_sched *s = sched_self();
+    struct epoll_event ev = { .events = events | EPOLLONESHOT, .data.ptr = io };
+
+    io->fd = fd;
+    io->events = events;
+    io->revents = 0;
+    io->pending = 0;
+    io->node = node;
+    io->sched = s;
+    if (epoll_fd(s) < 0 || epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return -1;
+    io->pending = 1;
+    s->io_num++;
+    return 0;
+}
+
+void co_io_cancel(struct co_io *io)
+{
+    struct co_sched *s = io->sched;
+
+    if (!io->pending)
+        return;
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, io->fd, NULL);
+    io->pending = 0;
+    s->io_num--;
+}
+
+int co_wait_io_until(int fd, int events, uint64_t deadline)
+{
+    struct co_node node;
+    struct co_io io;
+    co_node_init(&node, NULL);
+    if (co_io_start(&io, fd, events, &node) < 0)
+        return -1;
+    co_park_until(&node, deadline);
+    if (io.pending) {
+        co_io_cancel(&io);
+        return CO_TIMEDOUT;
+    }
+    return io.revents;
+}
+
+int co_wait_io(int fd, int events)
+{
+    return co_wait_io_until(fd, events, CO_FOREVER);
+}
+
+// timeout_ms 同 epoll_wait
+static void io_poll(struct co_sched *s, int timeout_ms)
+{
+    struct epoll_event evs[POLL_EVENTS];
+    int n = epoll_wait(epoll_fd(s), evs, POLL_EVENTS, timeout_ms);
+
+    s->stats.polls++;
+    for (int i = 0; i < n; i++) {
+        struct co_io *io = evs[i].data.ptr;
+        if (io == NULL) {
+            // 先清零计数再取 posts (在 co_schedule 中), 不会漏掉之后的 co_post
+            uint64_t cnt;
+            if (read(s->efd, &cnt, sizeof(cnt)) < 0)
+                debug("read eventfd: %d\n", errno);
+            continue;
         }
+        co_io_cancel(io);
+        io->revents = evs[i].events;
+        co_ready(io->node);
+    }
+}
+
+// ----------------------------------------------------------------
+// 调度
+// ----------------------------------------------------------------
 
-        assert(next != NULL);
+// 就绪队列为空时等待定时器或 I/O
+static void co_idle(struct co_sched *s)
+{
+    int timeout_ms = -1;
+    if (s->timer_num > 0) {
+        uint64_t now = co_now(), deadline = s->timers[0]->deadline;
+        timeout_ms = deadline <= now ? 0 : (int)((deadline - now + 999999) / 1000000);
+    }
+    // 没有定时器也没有 I/O 时仍然可能被别的线程 co_post 唤醒, 一直等下去
+    io_poll(s, timeout_ms);
+}
 
-        debug("switch to co %s\n", next->name);
+// ----------------------------------------------------------------
+// 跨线程唤醒: co_post 可以在任何线程 (包括信号处理函数) 中调用,
+// 只用原子操作把协程压进无锁栈, 栈由空变非空时写一次 eventfd
+// ----------------------------------------------------------------
 
-        if (next->status == CO_NEW) {
-            next->status = CO_RUNNING;
+void co_post(co_sched_t *s, struct co *co)
+{
+    if (__atomic_exchange_n(&co->posted, 1, __ATOMIC_ACQ_REL))
+        return;
 
-            current = next;
+    struct co *head = __atomic_load_n(&s->posts, __ATOMIC_RELAXED);
+    do {
+        co->post_next = head;
+    } while (!__atomic_compare_exchange_n(&s->posts, &head, co, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 
-            uintptr_t stack_top = (uintptr_t)(current->stack + STACK_SIZE);
-            stack_top = (stack_top - 1) & ~0xF;
-            
-            // ebx: stack_top -> %esp, edx: current->func, eax: current->arg -> 0x4(%ebx)? Should be (%ebx)
-            stack_switch_call((void *)stack_top, current->func, (uintptr_t)current->arg);
-            
-            // current is assigned to a local register %rcx
-            // why here not use %rbp? instead using rcx?
-            // NOTE: we must use a static global variable here to prevent the compiler
-            //       from using current as non-saved rcx. F**King compiler!
-            current->status = CO_DEAD;
-            co_yield ();
-        } else {
-            current = next;
-            longjmp(next->context, SWITCH_IN);
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(s->efd, &one, sizeof(one)) < 0)
+            debug("write eventfd: %d\n", errno);
+    }
+}
+
+static void post_drain(struct co_sched *s)
+{
+    struct co *list = __atomic_exchange_n(&s->posts, NULL, __ATOMIC_ACQUIRE), *fifo = NULL;
+
+    // 栈是后进先出的, 反转后按 co_post 的顺序放进就绪队列
+    while (list) {
+        struct co *next = list->post_next;
+        list->post_next = fifo;
+        fifo = list;
+        list = next;
+    }
+    while (fifo) {
+        struct co *co = fifo;
+        fifo = co->post_next;
+        if (co->inlining) {
+            // 它的 context 在内联执行的协程的栈帧下面, 现在切回去会破坏栈;
+            // posted 保持为 1, 之后的 co_post 都合并进来, 内联结束时再放进就绪队列
+            co->inlining = 2;
+            continue;
         }
+        __atomic_store_n(&co->posted, 0, __ATOMIC_RELEASE);
+        co_ready(&co->node);
+    }
+}
+
+// 每次切换到另一个栈之后调用: 之前在已结束的协程的栈上调度, 现在才能把那块栈还回去
+static void co_landed(struct co_sched *s)
+{
+    s->exiting = NULL;
+    if (s->release) {
+        co_stack_put(s->release, STACK_SIZE);
+        s->release = NULL;
+    }
+}
+
+// 切换到 next (不是当前协程), 不会返回
+static void co_switch(struct co_sched *s, struct co *next)
+{
+    debug("switch to co %s\n", next->name);
+    s->stats.switches++;
+    co_budget = CO_YIELD_BUDGET;
+    s->slice_start = 0;
+
+    if (next->status == CO_NEW) {
+        next->status = CO_RUNNING;
+        if (!next->stack && co_stack_alloc(next) < 0) {
+            fprintf(stderr, "libco: out of memory for stack of '%s'\n", next->name);
+            abort();
+        }
+
+        s->current = next;
+
+        uintptr_t stack_top = (uintptr_t)next->stack_top;
+        stack_top = (stack_top - 1) & ~0xF;
+
+        // ebx: stack_top -> %esp, edx: co_entry, eax: next -> 0x4(%ebx)? Should be (%ebx)
+        stack_switch_call((void *)stack_top, co_entry, (uintptr_t)next);
     } else {
-        debug("switch back to co %s\n", current->name);
-        /* context is restored by longjmp, do nothing */
-        return;
+        s->current = next;
+        longjmp(next->context, SWITCH_IN);
     }
 }
 
-__attribute__((constructor)) void co_main_init()
+// 当前协程的现场已经保存 (或已经结束), 选出下一个节点运行
+static void co_schedule(struct co_sched *s)
+{
+    for (;;) {
+        if (__atomic_load_n(&s->posts, __ATOMIC_RELAXED))
+            post_drain(s);
+        if (s->timer_num > 0)
+            timer_expire(s, co_now());
+        if (s->io_num > 0 && ++s->ticks % POLL_INTERVAL == 0)
+            io_poll(s, 0);
+
+        if (co_list_empty(&s->ready)) {
+            co_idle(s);
+            continue;
+        }
+
+        struct co_node *node = co_list_entry(s->ready.next, struct co_node, link);
+        co_list_del(&node->link);
+
+        if (node->fn) {
+            s->stats.callbacks++;
+            s->in_callback++;
+            node->fn(node);
+            s->in_callback--;
+            continue;
+        }
+
+        struct co *next = node->co;
+        assert(next->status != CO_DEAD && next->sched == s);
+        if (next == s->current)
+            return;
+        co_switch(s, next);
+    }
+}
+
+// ----------------------------------------------------------------
+// 调度器对象
+// ----------------------------------------------------------------
+
+co_sched_t *co_sched_create(void)
+{
+    struct co_sched *s = calloc(1, sizeof(struct co_sched));
+    if (!s)
+        return NULL;
+    co_list_init(&s->all);
+    co_list_init(&s->ready);
+    s->group.sched = s;
+    co_list_init(&s->group.waiting); // 其余为 0: 没有父组, 不限数量
+    s->epfd = -1;
+    s->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (s->efd < 0) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void co_sched_destroy(co_sched_t *s)
+{
+    assert(s->current == NULL);
+    while (!co_list_empty(&s->all)) {
+        struct co *co = co_list_entry(s->all.next, struct co, all);
+        // 运行过的协程的参数在它的栈帧里, 已经无从析构
+        if (co->status == CO_NEW && co->cleanup)
+            co->cleanup(co->arg);
+        co_free(co);
+    }
+    if (s->host)
+        co_free(s->host);
+    if (s->epfd >= 0)
+        close(s->epfd);
+    close(s->efd);
+    free(s->timers);
+    free(s);
+}
+
+static pthread_key_t sched_key;
+static pthread_once_t sched_once = PTHREAD_ONCE_INIT;
+
+// 线程退出时回收它的默认调度器 (eventfd、epoll、main 协程、定时器堆)
+// 线程若是在某个协程里 (或嵌套的 co_sched_run 里) 退出的, 析构就在那个协程的栈上运行, 只能放弃回收
+static void sched_default_free(void *arg)
+{
+    struct co_sched *s = arg;
+
+    if (sched != s || s->current != s->host)
+        return;
+    sched = NULL;
+    s->current = NULL;
+    co_sched_destroy(s);
+}
+
+static void sched_key_init(void)
+{
+    pthread_key_create(&sched_key, sched_default_free);
+}
+
+// 以前由 __attribute__((constructor)) 在加载时完成, 现在第一次用到时才初始化
+static struct co_sched *sched_default(void)
 {
     debug("co_main_init\n");
-    for (int i = 0; i < MAX_CO_NUM; ++i) {
-        co_pool.co[i] = NULL;
+    struct co_sched *s = co_sched_create();
+    assert(s != NULL);
+    s->host = s->current = co_create(s, "main", NULL, NULL);
+    assert(s->current != NULL);
+    pthread_once(&sched_once, sched_key_init);
+    pthread_setspecific(sched_key, s);
+    sched = s;
+    return s;
+}
+
+co_sched_t *co_sched_self(void)
+{
+    return sched_self();
+}
+
+// 让 s 成为本线程的当前调度器, 调用者的栈作为它的宿主协程.
+// 宿主协程第一次进入时创建, 之后一直留着, 外部循环反复 co_sched_run_once 不用每次分配
+static void sched_enter(struct co_sched *s)
+{
+    assert(s->current == NULL);
+    if (!s->host) {
+        s->host = co_create(s, "host", NULL, NULL);
+        assert(s->host != NULL);
     }
-    co_pool.co_num = 0;
-    co_pool.poller = 0;
-    current = co_start("main", NULL, NULL);
-}
\ No newline at end of file
+    s->outer = sched;
+    s->current = s->host;
+    sched = s;
+}
+
+static void sched_leave(struct co_sched *s)
+{
+    assert(s->current == s->host);
+    sched = s->outer;
+    s->outer = NULL;
+    s->current = NULL;
+}
+
+void co_sched_run(co_sched_t *s)
+{
+    struct co_node node;
+
+    if (s != sched) {
+        sched_enter(s);
+        co_sched_run(s);
+        sched_leave(s);
+        return;
+    }
+
+    // 已经在这个调度器里 (比如默认调度器的 main), 等待其余协程都结束
+    while (s->live > 0) {
+        co_node_init(&node, NULL);
+        s->drainer = &node;
+        co_park();
+    }
+}
+
+int co_sched_run_once(co_sched_t *s, uint64_t max_ns)
+{
+    if (s != sched) {
+        sched_enter(s);
+        int ret = co_sched_run_once(s, max_ns);
+        sched_leave(s);
+        return ret;
+    }
+
+    // 至少运行一轮, 否则 max_ns 很小 (或查看 I/O 就用完了时间) 时永远没有进展
+    uint64_t start = co_now();
+    do {
+        if (s->io_num > 0)
+            io_poll(s, 0);
+        if (__atomic_load_n(&s->posts, __ATOMIC_RELAXED))
+            post_drain(s);
+        if (s->timer_num > 0)
+            timer_expire(s, co_now());
+        if (co_list_empty(&s->ready))
+            return 0;
+        // 排到队尾再回来: 此前就绪的节点都运行一次
+        co_yield ();
+    } while (co_now() - start < max_ns);
+    return !co_list_empty(&s->ready);
+}
+
+int64_t co_sched_next_timeout(co_sched_t *s)
+{
+    if (!co_list_empty(&s->ready) || __atomic_load_n(&s->posts, __ATOMIC_RELAXED))
+        return 0;
+    if (s->timer_num == 0)
+        return -1;
+    uint64_t now = co_now(), deadline = s->timers[0]->deadline;
+    return deadline <= now ? 0 : (int64_t)(deadline - now);
+}
+
+int co_sched_fd(co_sched_t *s)
+{
+    return epoll_fd(s);
+}
+
+int co_run_once(uint64_t max_ns)
+{
+    return co_sched_run_once(sched_self(), max_ns);
+}
+
+int64_t co_next_timeout(void)
+{
+    return co_sched_next_timeout(sched_self());
+}
+
+void co_sched_set_inline(co_sched_t *s, int enable)
+{
+    s->inline_join = enable;
+}
+
+void co_sched_get_stats(co_sched_t *s, struct co_sched_stats *stats)
+{
+    *stats = s->stats;
+}
@@ -1,3 +1,414 @@
+#ifndef __CO_H__
+#define __CO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// co_start_with 在协程栈顶为参数预留的最大字节数
+#define CO_ARGS_MAX 1024
+
+#ifdef __cplusplus
+// C++ 中放进 namespace co, 避免 struct co 与 co.hpp 的 namespace co 重名
+namespace co {
+extern "C" {
+#endif
+
 struct co* co_start(const char *name, void (*func)(void *), void *arg);
+// 在协程栈顶预留 size 字节, 由 init(buf, ctx) 就地构造参数, 之后以 func(buf) 运行;
+// init 为 NULL 时直接从 ctx 复制 size 字节
+struct co* co_start_with(const char *name, void (*func)(void *), size_t size,
+                         void (*init)(void *buf, void *ctx), void *ctx);
+// 参数复制到协程自己的栈上, 调用者不必 malloc/free 参数结构体
+#define co_start_args(name, func, args) \
+    co_start_with((name), (func), sizeof(*(args)), NULL, (void *)(args))
+// 协程还没开始运行就随调度器一起被 co_sched_destroy 释放时, 调用 cleanup(参数) 析构参数
+void co_set_cleanup(struct co *co, void (*cleanup)(void *arg));
+#if defined(__cplusplus) && defined(__cpp_impl_coroutine)
+// C++20 起 co_yield 是关键字, 换个名字引用同一个符号
+void co_yield_(void) __asm__("co_yield");
+#else
 void co_yield();
+#endif
+// 可以有多个协程同时等待同一个 co, 最后一个返回的负责回收
 void co_wait(struct co *co);
+// 在长循环中代替 co_yield: 平时只是一次减一和比较, 每 CO_YIELD_BUDGET 次检查一下,
+// 本次已经连续运行了一个时间片并且有别的协程就绪 (或定时器到期、有 I/O 在等) 才真正让出
+#define CO_YIELD_BUDGET 64
+extern __thread int co_budget;
+void co_maybe_yield_slow(void);
+static inline void co_maybe_yield(void)
+{
+    if (--co_budget <= 0)
+        co_maybe_yield_slow();
+}
+// 带超时的等待, 见下面的 CO_FOREVER; 超时返回 CO_TIMEDOUT, 此时 co 没有被回收
+int co_wait_until(struct co *co, uint64_t deadline);
+int co_wait_timeout(struct co *co, uint64_t ns);
+// 等到 cos 中任意一个结束, 回收它并返回其下标; 其余的不受影响
+int co_wait_any(struct co **cos, int n);
+// 只挂起、唤醒一次, 等到全部结束并回收; 内存不足返回 -1 (此时一个也没有回收)
+int co_wait_all(struct co **cos, int n);
+
+// 每个协程有进程内唯一的 64 位编号; 名字被驻留, 同名协程共享一个名字编号,
+// 统计和跟踪只需保存、比较整数.
+// 驻留的名字永远不会释放: 运行时拼出来的名字 (比如带上序号) 每个都占一份内存, 只增不减
+uint64_t co_id(struct co *co);
+uint32_t co_name_id(struct co *co);
+uint32_t co_intern(const char *name);
+const char *co_name_of(uint32_t name_id);
+
+// ----------------------------------------------------------------
+// 调度器: 每个调度器有自己的就绪队列、定时器、I/O 和统计, 互相隔离.
+// co_start 等都作用于本线程当前的调度器, 第一次使用时才创建默认调度器
+// ----------------------------------------------------------------
+
+typedef struct co_sched co_sched_t;
+
+struct co_sched_stats {
+    uint64_t spawned;   // 创建的协程数
+    uint64_t switches;  // 协程切换次数
+    uint64_t callbacks; // 执行的节点回调数
+    uint64_t polls;     // epoll_wait 次数
+    uint64_t inlined;   // 在 co_wait 中内联执行的协程数
+};
+
+co_sched_t *co_sched_create(void);
+// 调度器中不能还有正在运行的 co_sched_run, 未回收的协程一并释放
+void co_sched_destroy(co_sched_t *s);
+co_sched_t *co_sched_self(void);
+// 在 s 中创建协程; s 不是当前的调度器时只放进它的就绪队列, 等 co_sched_run
+struct co* co_sched_start(co_sched_t *s, const char *name, void (*func)(void *), void *arg);
+// 在当前栈上运行 s, 直到其中的协程全部结束; 期间 co_start 等作用于 s
+void co_sched_run(co_sched_t *s);
+void co_sched_get_stats(co_sched_t *s, struct co_sched_stats *stats);
+// 内联模式: co_start 不再立即让出; 创建者 co_wait 一个还没开始运行的协程时,
+// 直接在自己的栈上执行它 (它中途挂起也没关系), 适合递归的 fork/join
+void co_sched_set_inline(co_sched_t *s, int enable);
+
+// 嵌入别的事件循环: 在循环里调用 co_run_once, 用 co_next_timeout 作为等待超时,
+// 并把 co_sched_fd (可读即有 I/O 就绪) 加入外部的 epoll/poll
+// 运行就绪的协程, 最多约 max_ns 纳秒; 返回 1 表示还有就绪的协程没有运行完
+int co_sched_run_once(co_sched_t *s, uint64_t max_ns);
+// 0: 有就绪的协程; -1: 只需等待 co_sched_fd; 否则为距离下一个定时器的纳秒数
+int64_t co_sched_next_timeout(co_sched_t *s);
+int co_sched_fd(co_sched_t *s);
+// 同上, 作用于本线程当前的调度器
+int co_run_once(uint64_t max_ns);
+int64_t co_next_timeout(void);
+
+// 在任何线程 (包括信号处理函数) 中唤醒 s 中挂起 (co_park) 的协程 co,
+// 最多一次 write(eventfd). co 把工作交给别的线程后应直接 co_park, 中间不要让出,
+// 这样即使对方在 co 挂起之前就 co_post 也不会丢失唤醒.
+// co 正在 co_wait 中内联执行它的子协程时, 唤醒推迟到内联结束, 留给 co 之后的 co_park
+void co_post(co_sched_t *s, struct co *co);
+
+// ----------------------------------------------------------------
+// 挂起与唤醒: 通道、定时器、I/O 等都建立在这几个原语之上
+// ----------------------------------------------------------------
+
+// 双向循环链表, 不在任何链表中时指向自己
+struct co_list {
+    struct co_list *next, *prev;
+};
+
+#define co_list_entry(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+static inline void co_list_init(struct co_list *l)
+{
+    l->next = l->prev = l;
+}
+
+static inline int co_list_empty(const struct co_list *l)
+{
+    return l->next == l;
+}
+
+static inline void co_list_add_tail(struct co_list *n, struct co_list *head)
+{
+    n->prev = head->prev;
+    n->next = head;
+    head->prev->next = n;
+    head->prev = n;
+}
+
+static inline void co_list_del(struct co_list *n)
+{
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    co_list_init(n);
+}
+
+// 唤醒节点: 被 co_ready 放进就绪队列, 轮到它时
+// fn == NULL 则切换到协程 co, 否则在调度器中调用 fn(node) (不能挂起)
+struct co_node {
+    struct co_list link;
+    void (*fn)(struct co_node *);
+    struct co *co;
+};
+
+struct co *co_self(void);
+// fn 为 NULL 时节点属于当前协程
+void co_node_init(struct co_node *node, void (*fn)(struct co_node *));
+void co_ready(struct co_node *node);
+// 挂起当前协程, 直到它的某个节点被 co_ready
+void co_park(void);
+// 协程结束时唤醒 node (可以有多个); 已经结束则返回 0, 之后仍需 co_wait 回收
+int co_wait_async(struct co *co, struct co_node *node);
+
+// 准入控制: 限制已放行且还没结束的协程数. 每个协程属于一个组, 要在本组和全部祖先组
+// (最终是调度器的根组, co_start 直接用它) 中都有名额才放行; 没有名额时按本组的策略:
+enum {
+    CO_LIMIT_BLOCK, // 协程排队, 创建者挂起到它被放行为止
+    CO_LIMIT_FAIL,  // 不创建, 返回 NULL, errno 为 EAGAIN
+    CO_LIMIT_QUEUE, // 协程排队 (还没有栈), 创建者立即返回
+};
+
+typedef struct co_group {
+    co_sched_t *sched;
+    struct co_group *parent;
+    int max;                // 0 表示不限
+    int live;               // 已放行且还没结束的协程数
+    int policy;
+    struct co_list waiting; // 卡在本组的协程
+} co_group_t;
+
+// parent 为 NULL 时挂在当前调度器的根组下
+void co_group_init(co_group_t *g, struct co_group *parent, int max, int policy);
+struct co* co_group_start(co_group_t *g, const char *name, void (*func)(void *), void *arg);
+// 设置根组的限制, max 为 0 表示不限
+void co_sched_set_limit(co_sched_t *s, int max, int policy);
+co_group_t *co_sched_group(co_sched_t *s);
+
+// 所有阻塞原语都有 *_until 版本, deadline 为 co_now() 的绝对时间, CO_FOREVER 表示不限;
+// 到期时返回 CO_TIMEDOUT, 操作被撤销
+#define CO_FOREVER UINT64_MAX
+#define CO_TIMEDOUT (-2)
+
+// 同 co_park, 但最晚在 deadline 时通过 node 唤醒; 到期返回 CO_TIMEDOUT.
+// node 可能同时被别人唤醒, 调用者应以自己的操作是否完成为准
+int co_park_until(struct co_node *node, uint64_t deadline);
+
+// 定时器, 时间均为 CLOCK_MONOTONIC 纳秒
+struct co_timer {
+    uint64_t deadline;
+    struct co_node *node;   // 到期时被 co_ready
+    int idx;                // 在堆中的下标, -1 表示未启动
+    struct co_sched *sched; // 启动时所在的调度器, 堆在它那里; 可以在别的调度器中取消
+};
+
+uint64_t co_now(void);
+void co_timer_init(struct co_timer *t);
+void co_timer_start(struct co_timer *t, uint64_t deadline, struct co_node *node);
+void co_timer_cancel(struct co_timer *t);
+void co_sleep(uint64_t ns);
+void co_sleep_until(uint64_t deadline);
+
+// fd 就绪等待, events 为 POLLIN/POLLOUT (与 EPOLLIN/EPOLLOUT 相同)
+struct co_io {
+    int fd;
+    int events;
+    int revents;
+    int pending;
+    struct co_node *node;   // 就绪时被 co_ready
+    struct co_sched *sched; // 注册到了哪个调度器的 epoll
+};
+
+int co_io_start(struct co_io *io, int fd, int events, struct co_node *node);
+void co_io_cancel(struct co_io *io);
+// 挂起直到 fd 就绪, 返回 revents, 出错返回 -1
+int co_wait_io(int fd, int events);
+int co_wait_io_until(int fd, int events, uint64_t deadline);
+
+// ----------------------------------------------------------------
+// 通道: 容量为 cap 的 void * 队列, cap 为 0 时为同步交接
+// ----------------------------------------------------------------
+
+struct chan;
+
+struct chan_op {
+    struct co_list link;  // 在通道等待队列中的位置
+    void *item;
+    int status;           // 1: 等待中, 0: 完成, -1: 通道已关闭
+    struct co_node *node; // 完成时被 co_ready
+};
+
+struct chan *chan_new(int cap);
+void chan_free(struct chan *ch);
+void chan_close(struct chan *ch);
+// 满/空时挂起; 成功返回 0, 通道已关闭返回 -1
+int chan_send(struct chan *ch, void *item);
+int chan_recv(struct chan *ch, void **item);
+int chan_send_until(struct chan *ch, void *item, uint64_t deadline);
+int chan_recv_until(struct chan *ch, void **item, uint64_t deadline);
+// 成批收发最多 n 个, 返回实际个数 (至少 1); 一个也收发不了时才挂起, 每批最多唤醒一次.
+// 通道已关闭 (接收时且为空) 返回 -1
+int chan_send_n(struct chan *ch, void **items, int n);
+int chan_recv_n(struct chan *ch, void **items, int n);
+int chan_send_n_until(struct chan *ch, void **items, int n, uint64_t deadline);
+int chan_recv_n_until(struct chan *ch, void **items, int n, uint64_t deadline);
+// 不挂起的版本: 能立即完成则返回 op->status, 否则返回 1, 完成后唤醒 op->node
+int chan_send_async(struct chan *ch, struct chan_op *op, void *item, struct co_node *node);
+int chan_recv_async(struct chan *ch, struct chan_op *op, struct co_node *node);
+void chan_cancel(struct chan *ch, struct chan_op *op);
+
+// ----------------------------------------------------------------
+// 信箱: 每个协程可以收消息, 消息存放在预先分配的环形缓冲区里.
+// 信箱满时发送者挂起, 空时接收者挂起, 收发双方直接交接; 协程结束后发送返回 -1
+// ----------------------------------------------------------------
+
+#define CO_MAILBOX_CAP 64
+
+// 用 cap 个槽位创建 co 的信箱; 不调用则第一次收发时以 CO_MAILBOX_CAP 创建
+int co_mailbox_open(struct co *co, int cap);
+int co_send(struct co *co, void *msg);
+int co_send_until(struct co *co, void *msg, uint64_t deadline);
+// 从当前协程的信箱取一条消息
+int co_recv(void **msg);
+int co_recv_until(void **msg, uint64_t deadline);
+
+// ----------------------------------------------------------------
+// 令牌桶限速: 每秒补充 rate 个令牌, 最多攒 burst 个.
+// 令牌不够时挂起, 按先来后到放行, 只用一个定时器 (为队首的等待者定时)
+// ----------------------------------------------------------------
+
+struct co_ratelimit {
+    uint64_t rate, burst;
+    uint64_t tokens;         // 单位为 1e-9 个令牌
+    uint64_t last;           // 上次补充的时间
+    struct co_list waiters;
+    struct co_timer timer;
+    struct co_node timer_node;
+};
+
+// 初始时桶是满的
+void co_ratelimit_init(struct co_ratelimit *rl, uint64_t rate, uint64_t burst);
+// 取 n (不超过 burst) 个令牌
+int co_ratelimit_acquire(struct co_ratelimit *rl, uint64_t n);
+int co_ratelimit_acquire_until(struct co_ratelimit *rl, uint64_t n, uint64_t deadline);
+// 不挂起, 令牌不够或有人在排队时返回 -1
+int co_ratelimit_try_acquire(struct co_ratelimit *rl, uint64_t n);
+
+// ----------------------------------------------------------------
+// worker 池: 固定数量的长期运行的协程从任务环中取任务执行, 没有任务时挂起.
+// 提交任务只是把函数和参数复制进环, 不创建协程也不分配栈
+// ----------------------------------------------------------------
+
+#define CO_JOB_ARGS 48 // 任务参数的最大字节数
+
+typedef struct co_workers co_workers_t;
+
+// 在当前调度器中创建 workers 个协程, 任务环有 cap 个槽位
+co_workers_t *co_workers_new(const char *name, int workers, int cap);
+// 复制 size 字节的参数, 之后在某个 worker 中执行 fn(参数的副本); 环满时挂起, 池已关闭返回 -1
+int co_workers_submit(co_workers_t *p, void (*fn)(void *args), const void *args, size_t size);
+// 不挂起的版本, 环满时返回 -1, 可以在节点回调中使用
+int co_workers_try_submit(co_workers_t *p, void (*fn)(void *args), const void *args, size_t size);
+#define co_workers_submit_args(p, fn, args) \
+    co_workers_submit((p), (fn), (args), sizeof(*(args)))
+// 不再接受任务, 等已提交的任务全部完成后释放
+void co_workers_free(co_workers_t *p);
+
+// ----------------------------------------------------------------
+// 流水线: 若干阶段, 每个阶段由若干协程运行, 相邻阶段之间是有界的缓冲.
+// 数据按最多 batch 个一批交接, 每批只需一次唤醒和切换; 缓冲满时上游自动挂起
+// ----------------------------------------------------------------
+
+#define CO_PIPELINE_MAX 16
+
+struct co_pipeline;
+struct co_emit; // 阶段的输出端
+
+// 相邻阶段之间最多排队 depth 批
+struct co_pipeline *co_pipeline_new(int batch, int depth);
+// 追加一个由 workers 个协程运行的阶段, 每个输入调用一次 fn(item, out, ctx)
+int co_pipeline_stage(struct co_pipeline *p, const char *name,
+                      void (*fn)(void *item, struct co_emit *out, void *ctx), void *ctx, int workers);
+// 在阶段函数中把 item 交给下一个阶段, 最后一个阶段不能调用
+void co_pipeline_emit(struct co_emit *out, void *item);
+// 创建各阶段的协程
+int co_pipeline_start(struct co_pipeline *p);
+// 向第一个阶段输入; 缓冲满时挂起
+void co_pipeline_push(struct co_pipeline *p, void *item);
+// 输入结束: 等所有阶段处理完, 然后释放 p
+void co_pipeline_finish(struct co_pipeline *p);
+
+// ----------------------------------------------------------------
+// future: 只赋值一次的结果, 值直接存放在结构体里.
+// 生产者 co_promise_set, 消费者 co_future_get 挂起等待, 或用 co_future_then 挂一个回调节点,
+// 完成时在调度器中运行回调, 不需要为简单的后续处理创建协程
+// ----------------------------------------------------------------
+
+#define CO_FUTURE_INLINE 32
+
+struct co_future {
+    int ready;
+    size_t size;
+    struct co_list waiters; // 元素为 struct co_node
+    union {
+        void *ptr;
+        int64_t i64;
+        double f64;
+        uint8_t bytes[CO_FUTURE_INLINE];
+    } value;
+};
+
+void co_future_init(struct co_future *f);
+// 复制 size (不超过 CO_FUTURE_INLINE) 字节的值并唤醒所有等待者; 只能调用一次, 不会挂起
+void co_promise_set(struct co_future *f, const void *value, size_t size);
+// 挂起直到完成, 返回指向值的指针
+void *co_future_get(struct co_future *f);
+// 超时返回 NULL
+void *co_future_get_until(struct co_future *f, uint64_t deadline);
+// 完成时 co_ready(node) (已经完成则立即); node->fn 非空时就是回调, 可以在其中再 co_promise_set
+void co_future_then(struct co_future *f, struct co_node *node);
+
+// ----------------------------------------------------------------
+// 互斥锁: 只在协程之间互斥, 不能跨线程; 解锁时直接把锁交给队首的等待者
+// ----------------------------------------------------------------
+
+struct co_mutex {
+    struct co *owner;
+    struct co_list waiters; // 元素为 struct co_mutex_waiter (见 mutex.c)
+};
+
+void co_mutex_init(struct co_mutex *m);
+// 成功返回 0, 锁已被占用返回 -1
+int co_mutex_trylock(struct co_mutex *m);
+void co_mutex_lock(struct co_mutex *m);
+int co_mutex_lock_until(struct co_mutex *m, uint64_t deadline);
+void co_mutex_unlock(struct co_mutex *m);
+
+// ----------------------------------------------------------------
+// fork/join: 用于递归的并行算法, 与上面的调度器无关.
+// co_fork 立即在新栈上执行 func(arg), 空闲的 worker 线程偷走调用者的后续部分并行执行;
+// co_sync 等待本任务 fork 出的全部子任务 (任务结束时隐含一次 co_sync).
+// 任务可能在不同的线程上恢复, 不要在 co_fork/co_sync 前后使用线程局部变量
+// 调用者的后续部分可能在子任务读取 arg 之前就被偷走继续执行, arg 指向的对象要活到 co_sync;
+// 隐含的 co_sync 只在任务的入口函数返回之后, 保护不了中间各层函数的局部变量
+// ----------------------------------------------------------------
+
+// 在 workers 个线程 (包括调用者) 上运行 root(arg), 直到它及其子任务全部结束; 返回偷取次数
+uint64_t co_fj_run(int workers, void (*root)(void *), void *arg);
+void co_fork(void (*func)(void *), void *arg);
+void co_sync(void);
+// 当前 worker 的编号, 不在 co_fj_run 中时返回 -1
+int co_fj_worker(void);
+
+// 把 [begin, end) 切成不超过 grain 的块, 并行调用 fn(块的 begin, end, ctx); grain 为 0 时自动选择.
+// 在 co_fj_run 之外调用时自己以 CPU 数个 worker 运行
+void co_parallel_for(long begin, long end, long grain,
+                     void (*fn)(long begin, long end, void *ctx), void *ctx);
+// 同上, 但每块由 map 累加进一个 size 字节 (不超过 256) 的累加器, 再用 combine(左, 右) 按顺序合并进 acc.
+// init 把累加器置为单位元; acc 由调用者初始化, 结果为 acc 与整个区间的合并
+void co_parallel_reduce(long begin, long end, long grain, void *acc, size_t size,
+                        void (*init)(void *acc, void *ctx),
+                        void (*map)(long begin, long end, void *acc, void *ctx),
+                        void (*combine)(void *acc, const void *other, void *ctx), void *ctx);
+
+#ifdef __cplusplus
+}
+}
+#endif
+
+#endif
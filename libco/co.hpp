@@ -0,0 +1,640 @@
+#ifndef __CO_HPP__
+#define __CO_HPP__
+
+#include "co.h"
+#include <assert.h>
+#include <errno.h>
+#include <new>
+#include <optional>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#include <exception>
+#endif
+
+namespace co {
+
+inline void yield()
+{
+#ifdef __cpp_impl_coroutine
+    co_yield_();
+#else
+    co_yield();
+#endif
+}
+
+// 协程句柄: 只能移动, 析构时等待协程结束 (类似 std::jthread)
+// 可调用对象直接构造在协程栈顶, 不需要额外的堆分配
+class task {
+public:
+    task() noexcept = default;
+
+    template <class F, class Fn = std::decay_t<F>,
+              class = std::enable_if_t<!std::is_same<Fn, task>::value>>
+    explicit task(const char *name, F &&fn)
+    {
+        static_assert(sizeof(Fn) <= CO_ARGS_MAX, "callable too large for the coroutine stack");
+        static_assert(alignof(Fn) <= 16, "over-aligned callable");
+        static_assert(std::is_invocable<Fn &>::value, "task needs a callable taking no arguments");
+
+        using Src = std::remove_reference_t<F>;
+        errno = 0;
+        co_ = co_start_with(name, &entry<Fn>, sizeof(Fn), &construct<Fn, F, Src>,
+                            const_cast<std::remove_const_t<Src> *>(std::addressof(fn)));
+        if (!co_) {
+            // CO_LIMIT_FAIL 的组已满, 与内存不足区分开
+            if (errno == EAGAIN)
+                throw std::system_error(EAGAIN, std::generic_category(), "co::task: admission refused");
+            throw std::bad_alloc();
+        }
+        co_set_cleanup(co_, &destroy<Fn>);
+    }
+
+    task(task &&other) noexcept : co_(std::exchange(other.co_, nullptr)) {}
+
+    task &operator=(task &&other) noexcept
+    {
+        if (this != &other) {
+            join();
+            co_ = std::exchange(other.co_, nullptr);
+        }
+        return *this;
+    }
+
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+
+    ~task() { join(); }
+
+    bool joinable() const noexcept { return co_ != nullptr; }
+
+    void join() noexcept
+    {
+        if (co_)
+            co_wait(std::exchange(co_, nullptr));
+    }
+
+    struct co *native_handle() const noexcept { return co_; }
+
+private:
+    // co_start_with 在返回 (和第一次调度) 之前调用, 此时 src 仍然有效
+    template <class Fn, class F, class Src>
+    static void construct(void *buf, void *src)
+    {
+        ::new (buf) Fn(std::forward<F>(*static_cast<Src *>(src)));
+    }
+
+    // 协程没有运行过就被 co_sched_destroy 释放
+    template <class Fn>
+    static void destroy(void *buf) noexcept
+    {
+        static_cast<Fn *>(buf)->~Fn();
+    }
+
+    // 协程入口; 异常不能穿过 setjmp/longjmp 的栈, 直接 terminate
+    template <class Fn>
+    static void entry(void *buf) noexcept
+    {
+        Fn *fn = static_cast<Fn *>(buf);
+        (*fn)();
+        fn->~Fn();
+    }
+
+    struct co *co_ = nullptr;
+};
+
+#ifdef __cpp_impl_coroutine
+// ----------------------------------------------------------------
+// C++20 无栈协程与 libco 共用同一个调度器:
+// 无栈协程被唤醒时以节点回调的形式在调度器中恢复,
+// 有栈协程通过 co::await 等待任何 awaitable (包括 co::async)
+// ----------------------------------------------------------------
+
+namespace detail {
+
+// 被唤醒后恢复一个无栈协程; node 必须是第一个成员
+struct resumer {
+    struct co_node node;
+    std::coroutine_handle<> handle;
+
+    explicit resumer(std::coroutine_handle<> h = {}) noexcept : handle(h) { co_node_init(&node, &fire); }
+
+    static void fire(struct co_node *n) noexcept { reinterpret_cast<resumer *>(n)->handle.resume(); }
+};
+
+template <class T>
+struct result {
+    std::optional<T> value;
+    void return_value(T v) { value.emplace(std::move(v)); }
+    T take() { return std::move(*value); }
+};
+
+template <>
+struct result<void> {
+    void return_void() noexcept {}
+    void take() noexcept {}
+};
+
+} // namespace detail
+
+// 惰性启动的无栈协程, 被 co_await 时才开始运行, 结束后恢复等待者
+template <class T = void>
+class async {
+public:
+    struct promise_type : detail::result<T> {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+        bool detached = false;
+        detail::resumer starter; // co::spawn 用来把协程放进就绪队列
+
+        async get_return_object() noexcept { return async(handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+            {
+                promise_type &p = h.promise();
+                if (p.detached) {
+                    if (p.error)
+                        std::terminate();
+                    h.destroy();
+                    return std::noop_coroutine();
+                }
+                return p.continuation ? p.continuation : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+
+        final_awaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() noexcept { error = std::current_exception(); }
+    };
+
+    using handle = std::coroutine_handle<promise_type>;
+
+    async(async &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+    async &operator=(async &&other) noexcept
+    {
+        if (this != &other) {
+            if (h_)
+                h_.destroy();
+            h_ = std::exchange(other.h_, {});
+        }
+        return *this;
+    }
+    ~async()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return !h_ || h_.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+    {
+        h_.promise().continuation = c;
+        return h_;
+    }
+
+    T await_resume()
+    {
+        if (h_.promise().error)
+            std::rethrow_exception(h_.promise().error);
+        return h_.promise().take();
+    }
+
+    handle release() noexcept { return std::exchange(h_, {}); }
+
+private:
+    explicit async(handle h) noexcept : h_(h) {}
+    handle h_;
+};
+
+// 把无栈协程交给调度器运行, 结束时自动销毁
+inline void spawn(async<void> t)
+{
+    auto h = t.release();
+    auto &p = h.promise();
+    p.detached = true;
+    p.starter.handle = h;
+    co_ready(&p.starter.node);
+}
+
+// co_await co::reschedule(): 让出调度器, 排到就绪队列末尾
+class reschedule {
+public:
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        r_.handle = h;
+        co_ready(&r_.node);
+    }
+    void await_resume() const noexcept {}
+
+private:
+    detail::resumer r_;
+};
+
+// co_await co::sleep_for(ns)
+class sleep_for {
+public:
+    explicit sleep_for(uint64_t ns) noexcept : ns_(ns) { co_timer_init(&timer_); }
+    ~sleep_for() { co_timer_cancel(&timer_); }
+
+    bool await_ready() const noexcept { return ns_ == 0; }
+    void await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        r_.handle = h;
+        co_timer_start(&timer_, co_now() + ns_, &r_.node);
+    }
+    void await_resume() const noexcept {}
+
+private:
+    uint64_t ns_;
+    struct co_timer timer_;
+    detail::resumer r_;
+};
+
+// co_await co::wait_io(fd, POLLIN), 结果为 revents, 出错为 -1
+class wait_io {
+public:
+    wait_io(int fd, int events) noexcept : fd_(fd), events_(events) { io_.pending = 0; }
+    ~wait_io() { co_io_cancel(&io_); }
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        r_.handle = h;
+        if (co_io_start(&io_, fd_, events_, &r_.node) < 0) {
+            io_.revents = -1;
+            return false;
+        }
+        return true;
+    }
+    int await_resume() const noexcept { return io_.revents; }
+
+private:
+    int fd_, events_;
+    struct co_io io_;
+    detail::resumer r_;
+};
+
+// co_await co::send(ch, item) / co::recv(ch), 结果同 chan_send/chan_recv 的返回值
+class send {
+public:
+    send(struct chan *ch, void *item) noexcept : ch_(ch), item_(item) { op_.status = 0; }
+    ~send() { chan_cancel(ch_, &op_); }
+
+    bool await_ready() noexcept { return chan_send_async(ch_, &op_, item_, &r_.node) != 1; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { r_.handle = h; }
+    int await_resume() const noexcept { return op_.status; }
+
+private:
+    struct chan *ch_;
+    void *item_;
+    struct chan_op op_;
+    detail::resumer r_;
+};
+
+class recv {
+public:
+    explicit recv(struct chan *ch) noexcept : ch_(ch) { op_.status = 0; }
+    ~recv() { chan_cancel(ch_, &op_); }
+
+    bool await_ready() noexcept { return chan_recv_async(ch_, &op_, &r_.node) != 1; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { r_.handle = h; }
+    // 通道关闭时为 nullopt
+    std::optional<void *> await_resume() const noexcept
+    {
+        if (op_.status != 0)
+            return std::nullopt;
+        return op_.item;
+    }
+
+private:
+    struct chan *ch_;
+    struct chan_op op_;
+    detail::resumer r_;
+};
+
+// co_await co::join(t): 等待有栈协程结束
+class join {
+public:
+    explicit join(task &t) noexcept : t_(t) {}
+
+    bool await_ready() const noexcept { return !t_.joinable(); }
+    bool await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        r_.handle = h;
+        return co_wait_async(t_.native_handle(), &r_.node) != 0;
+    }
+    // 已经结束, join 只是回收资源, 不会挂起
+    void await_resume() noexcept { t_.join(); }
+
+private:
+    task &t_;
+    detail::resumer r_;
+};
+
+namespace detail {
+
+// 立即开始运行, 结束时自行销毁的无栈协程, 只在 co::await 中使用
+struct bridge {
+    struct promise_type {
+        bridge get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+template <class T>
+struct await_state {
+    std::optional<T> value;
+    std::exception_ptr error;
+    bool done = false, parked = false;
+    struct co_node node;
+};
+
+template <>
+struct await_state<void> {
+    std::exception_ptr error;
+    bool done = false, parked = false;
+    struct co_node node;
+};
+
+template <class T, class A>
+bridge await_bridge(await_state<T> &st, A &&aw)
+{
+    try {
+        if constexpr (std::is_void_v<T>)
+            co_await std::forward<A>(aw);
+        else
+            st.value.emplace(co_await std::forward<A>(aw));
+    } catch (...) {
+        st.error = std::current_exception();
+    }
+    st.done = true;
+    if (st.parked)
+        co_ready(&st.node);
+}
+
+template <class A>
+decltype(auto) awaiter_of(A &&a)
+{
+    if constexpr (requires { std::forward<A>(a).operator co_await(); })
+        return std::forward<A>(a).operator co_await();
+    else
+        return std::forward<A>(a);
+}
+
+} // namespace detail
+
+// 在有栈协程中等待一个 awaitable (比如 co::async), 期间当前协程挂起, 其他协程照常运行
+template <class A>
+decltype(auto) await(A &&aw)
+{
+    using T = decltype(detail::awaiter_of(std::forward<A>(aw)).await_resume());
+    using V = std::conditional_t<std::is_void_v<T>, void, std::remove_cvref_t<T>>;
+
+    detail::await_state<V> st;
+    co_node_init(&st.node, nullptr);
+    detail::await_bridge<V, A>(st, std::forward<A>(aw));
+    if (!st.done) {
+        st.parked = true;
+        co_park();
+    }
+    if (st.error)
+        std::rethrow_exception(st.error);
+    if constexpr (!std::is_void_v<V>)
+        return std::move(*st.value);
+}
+#endif
+
+// 类型化的有界通道, 元素直接保存在对象内的环形缓冲区中, 不需要逐个分配;
+// N 为 0 时为同步交接. 等待者挂在通道上, 有接收者在等时缓冲区必为空
+template <class T, size_t N>
+class channel {
+public:
+    channel() noexcept
+    {
+        co_list_init(&senders_);
+        co_list_init(&receivers_);
+    }
+
+    channel(const channel &) = delete;
+    channel &operator=(const channel &) = delete;
+
+    ~channel()
+    {
+        assert(co_list_empty(&senders_) && co_list_empty(&receivers_));
+        if constexpr (N > 0) {
+            while (num_ > 0)
+                pop_front();
+        }
+    }
+
+    size_t size() const noexcept { return num_; }
+    bool closed() const noexcept { return closed_; }
+
+    // 唤醒所有等待者; 之后 send 失败, recv 取完剩余元素后返回 nullopt
+    void close() noexcept
+    {
+        closed_ = true;
+        while (waiter *w = pop(&senders_))
+            finish(w, -1);
+        while (waiter *w = pop(&receivers_))
+            finish(w, -1);
+    }
+
+    // 满时挂起当前 (有栈) 协程, 最晚等到 deadline; 通道已关闭或超时返回 false
+    bool send(T value, uint64_t deadline = CO_FOREVER)
+    {
+        struct co_node node;
+        co_node_init(&node, nullptr);
+        waiter w(&node, &value, nullptr);
+        if (try_send(w))
+            park(w, deadline);
+        return w.status == 0;
+    }
+
+    // 空时挂起当前 (有栈) 协程, 最晚等到 deadline; 通道已关闭且为空或超时返回 nullopt
+    std::optional<T> recv(uint64_t deadline = CO_FOREVER)
+    {
+        std::optional<T> out;
+        struct co_node node;
+        co_node_init(&node, nullptr);
+        waiter w(&node, nullptr, &out);
+        if (try_recv(w))
+            park(w, deadline);
+        return out;
+    }
+
+private:
+    struct waiter {
+        struct co_list link;
+        struct co_node *node;    // 完成时被 co_ready
+        T *in;                   // 发送者: 待发送的值
+        std::optional<T> *out;   // 接收者: 收到的值放在这里
+        int status;              // 1: 等待中, 0: 完成, -1: 通道已关闭
+
+        waiter(struct co_node *n, T *i, std::optional<T> *o) noexcept : node(n), in(i), out(o), status(0)
+        {
+            co_list_init(&link);
+        }
+    };
+
+    union slot {
+        slot() noexcept {}
+        ~slot() {}
+        T value;
+    };
+
+    static waiter *pop(struct co_list *q) noexcept
+    {
+        if (co_list_empty(q))
+            return nullptr;
+        waiter *w = co_list_entry(q->next, waiter, link);
+        co_list_del(&w->link);
+        return w;
+    }
+
+    static void finish(waiter *w, int status) noexcept
+    {
+        w->status = status;
+        co_ready(w->node);
+    }
+
+    void push_back(T &&value)
+    {
+        ::new (&buf_[(head_ + num_) % N].value) T(std::move(value));
+        num_++;
+    }
+
+    T pop_front()
+    {
+        T &front = buf_[head_].value;
+        T value(std::move(front));
+        front.~T();
+        head_ = (head_ + 1) % N;
+        num_--;
+        return value;
+    }
+
+    // 能立即完成返回 false, 否则排队并返回 true
+    bool try_send(waiter &w)
+    {
+        if (closed_) {
+            w.status = -1;
+            return false;
+        }
+        if (waiter *r = pop(&receivers_)) {
+            r->out->emplace(std::move(*w.in));
+            finish(r, 0);
+            return false;
+        }
+        if constexpr (N > 0) {
+            if (num_ < N) {
+                push_back(std::move(*w.in));
+                return false;
+            }
+        }
+        w.status = 1;
+        co_list_add_tail(&w.link, &senders_);
+        return true;
+    }
+
+    bool try_recv(waiter &w)
+    {
+        if constexpr (N > 0) {
+            if (num_ > 0) {
+                w.out->emplace(pop_front());
+                // 腾出了位置, 把一个等待的发送者的值放进来
+                if (waiter *s = pop(&senders_)) {
+                    push_back(std::move(*s->in));
+                    finish(s, 0);
+                }
+                return false;
+            }
+        }
+        if (waiter *s = pop(&senders_)) {
+            w.out->emplace(std::move(*s->in));
+            finish(s, 0);
+            return false;
+        }
+        if (closed_) {
+            w.status = -1;
+            return false;
+        }
+        w.status = 1;
+        co_list_add_tail(&w.link, &receivers_);
+        return true;
+    }
+
+    void cancel(waiter &w) noexcept
+    {
+        if (w.status == 1)
+            co_list_del(&w.link);
+    }
+
+    void park(waiter &w, uint64_t deadline) noexcept
+    {
+        co_park_until(w.node, deadline);
+        if (w.status == 1) {
+            cancel(w);
+            w.status = CO_TIMEDOUT;
+        }
+    }
+
+public:
+#ifdef __cpp_impl_coroutine
+    // co_await ch.async_send(v) / ch.async_recv(), 在 C++20 协程中使用
+    class send_awaiter {
+    public:
+        send_awaiter(channel &ch, T value) : ch_(ch), value_(std::move(value)), w_(&r_.node, &value_, nullptr) {}
+        ~send_awaiter() { ch_.cancel(w_); }
+
+        bool await_ready() { return !ch_.try_send(w_); }
+        void await_suspend(std::coroutine_handle<> h) noexcept { r_.handle = h; }
+        bool await_resume() const noexcept { return w_.status == 0; }
+
+    private:
+        channel &ch_;
+        T value_;
+        detail::resumer r_;
+        waiter w_;
+    };
+
+    class recv_awaiter {
+    public:
+        explicit recv_awaiter(channel &ch) : ch_(ch), w_(&r_.node, nullptr, &out_) {}
+        ~recv_awaiter() { ch_.cancel(w_); }
+
+        bool await_ready() { return !ch_.try_recv(w_); }
+        void await_suspend(std::coroutine_handle<> h) noexcept { r_.handle = h; }
+        std::optional<T> await_resume() { return std::move(out_); }
+
+    private:
+        channel &ch_;
+        std::optional<T> out_;
+        detail::resumer r_;
+        waiter w_;
+    };
+
+    send_awaiter async_send(T value) { return send_awaiter(*this, std::move(value)); }
+    recv_awaiter async_recv() { return recv_awaiter(*this); }
+#endif
+
+private:
+    slot buf_[N > 0 ? N : 1];
+    size_t head_ = 0, num_ = 0;
+    bool closed_ = false;
+    struct co_list senders_, receivers_;
+};
+
+} // namespace co
+
+#endif
@@ -0,0 +1,416 @@
+#include "co.h"
+#include "arch.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// fork/join: co_fork 先执行子任务 (work-first), 把父任务的现场留在本 worker 的双端队列底部,
+// 空闲的 worker 从别人队列的顶部偷走最老的父任务现场 (continuation stealing) 在自己的线程上继续.
+// 每个任务有自己的栈, 所以被偷走的父任务可以在任何线程上恢复
+
+#define FJ_STACK_SIZE (64 * 1024)
+#define FJ_DEQUE_SIZE 4096 // 队列里只有一条祖先链, 容量大于递归深度即可
+#define FJ_REDUCE_MAX 256  // co_parallel_reduce 的累加器放在任务栈上, 限制大小
+
+struct fj_task {
+    jmp_buf context;
+    struct fj_task *parent;
+    int pending;            // 未结束的子任务数 + 1 (自己还没在 co_sync 中挂起)
+    void (*func)(void *);
+    void *arg;
+    // 之后直到 FJ_STACK_SIZE 都是任务的栈
+};
+
+struct fj_pool;
+
+struct fj_worker {
+    struct fj_pool *pool;
+    int idx;
+    pthread_t thread;
+    unsigned seed;
+    jmp_buf loop;            // 调度循环, 在线程自己的栈上
+    struct fj_task *current;
+    struct fj_task *release; // 切换到别的栈之后再回收 (刚结束的任务)
+    struct fj_task *syncing; // 切换到调度循环之后再让 pending 减一
+    uint64_t steals;
+
+    // Chase-Lev 双端队列: 本 worker 在 bottom 端压入弹出, 别人从 top 端偷
+    long top, bottom;
+    struct fj_task *deque[FJ_DEQUE_SIZE];
+};
+
+struct fj_pool {
+    int num;
+    int done;
+    struct fj_worker *workers;
+};
+
+static __thread struct fj_worker *fj_worker;
+
+// 任务可能在别的线程上恢复, 不能让编译器把线程局部变量的地址缓存在寄存器里
+static __attribute__((noinline)) struct fj_worker *fj_self(void)
+{
+    struct fj_worker *w = fj_worker;
+    asm volatile("" ::: "memory");
+    return w;
+}
+
+// ----------------------------------------------------------------
+// 双端队列
+// ----------------------------------------------------------------
+
+static void deque_push(struct fj_worker *w, struct fj_task *t)
+{
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+
+    assert(b - top < FJ_DEQUE_SIZE);
+    __atomic_store_n(&w->deque[b % FJ_DEQUE_SIZE], t, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+static struct fj_task *deque_pop(struct fj_worker *w)
+{
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+
+    if (top > b) {
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    struct fj_task *t = __atomic_load_n(&w->deque[b % FJ_DEQUE_SIZE], __ATOMIC_RELAXED);
+    if (top == b) {
+        // 最后一个元素, 和小偷抢
+        if (!__atomic_compare_exchange_n(&w->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            t = NULL;
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return t;
+}
+
+static struct fj_task *deque_steal(struct fj_worker *w)
+{
+    long top = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= b)
+        return NULL;
+    struct fj_task *t = __atomic_load_n(&w->deque[top % FJ_DEQUE_SIZE], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&w->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return t;
+}
+
+// ----------------------------------------------------------------
+// 任务
+// ----------------------------------------------------------------
+
+static struct fj_task *task_alloc(void (*func)(void *), void *arg, struct fj_task *parent)
+{
+    // 栈池按线程后进先出, 刚结束的任务的栈马上给下一个 fork 用
+    struct fj_task *t = co_stack_get(FJ_STACK_SIZE);
+    if (!t) {
+        fprintf(stderr, "libco: out of memory for fork/join stack\n");
+        abort();
+    }
+    t->parent = parent;
+    t->pending = 1;
+    t->func = func;
+    t->arg = arg;
+    return t;
+}
+
+static void task_free(struct fj_task *t)
+{
+    co_stack_put(t, FJ_STACK_SIZE);
+}
+
+static void fj_resume(struct fj_worker *w, struct fj_task *t)
+{
+    w->current = t;
+    longjmp(t->context, 1);
+}
+
+// 每次切换到另一个栈之后调用, 此时才能回收上一个任务的栈
+static void fj_landed(void)
+{
+    struct fj_worker *w = fj_self();
+    if (w->release) {
+        task_free(w->release);
+        w->release = NULL;
+    }
+}
+
+static void fj_finish(struct fj_task *t)
+{
+    struct fj_worker *w = fj_self();
+    struct fj_task *p = t->parent;
+
+    w->release = t;
+    if (!p) {
+        __atomic_store_n(&w->pool->done, 1, __ATOMIC_RELEASE);
+        longjmp(w->loop, 1);
+    }
+    struct fj_task *bottom = deque_pop(w);
+    if (bottom) {
+        // 父任务没被偷走, 回到它的 co_fork 之后继续; 它还没 co_sync, pending 不会减到 0
+        assert(bottom == p);
+        __atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL);
+        fj_resume(w, p);
+    }
+    if (__atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        // 父任务已经在 co_sync 中挂起, 由最后结束的子任务接着运行它
+        __atomic_store_n(&p->pending, 1, __ATOMIC_RELEASE);
+        fj_resume(w, p);
+    }
+    longjmp(w->loop, 1);
+}
+
+static void fj_entry(struct fj_task *t)
+{
+    struct fj_worker *w = fj_self();
+
+    // 已经离开父任务的栈, 这时父任务才能被偷走
+    if (t->parent)
+        deque_push(w, t->parent);
+    w->current = t;
+    t->func(t->arg);
+    co_sync(); // 隐式 sync, 可能换了线程
+    fj_finish(t);
+}
+
+static void fj_start(struct fj_task *t)
+{
+    uintptr_t stack_top = ((uintptr_t)t + FJ_STACK_SIZE - 1) & ~0xF;
+    stack_switch_call((void *)stack_top, fj_entry, (uintptr_t)t);
+}
+
+void co_fork(void (*func)(void *), void *arg)
+{
+    struct fj_worker *w = fj_self();
+    struct fj_task *self = w->current;
+
+    assert(self != NULL); // 只能在 co_fj_run 中调用
+    __atomic_add_fetch(&self->pending, 1, __ATOMIC_RELAXED);
+    if (setjmp(self->context) == 0)
+        fj_start(task_alloc(func, arg, self));
+    fj_landed();
+}
+
+void co_sync(void)
+{
+    struct fj_worker *w = fj_self();
+    struct fj_task *self = w->current;
+
+    // 没有被偷过时子任务总是已经结束了
+    if (__atomic_load_n(&self->pending, __ATOMIC_ACQUIRE) == 1)
+        return;
+    // 先离开自己的栈再减 pending, 否则最后一个子任务可能在别的线程上同时用这块栈
+    if (setjmp(self->context) == 0) {
+        w->syncing = self;
+        longjmp(w->loop, 1);
+    }
+    fj_landed();
+}
+
+// ----------------------------------------------------------------
+// worker
+// ----------------------------------------------------------------
+
+static struct fj_task *fj_steal(struct fj_worker *w)
+{
+    struct fj_pool *pool = w->pool;
+    int start = rand_r(&w->seed) % pool->num;
+
+    for (int i = 0; i < pool->num; ++i) {
+        struct fj_worker *victim = &pool->workers[(start + i) % pool->num];
+        struct fj_task *t;
+        if (victim != w && (t = deque_steal(victim)) != NULL) {
+            w->steals++;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// 每次回到调度循环都从 setjmp 处重新开始, 之前的局部变量都不再使用
+static void fj_loop(struct fj_task *first)
+{
+    if (setjmp(fj_self()->loop) == 0 && first)
+        fj_start(first);
+
+    struct fj_worker *w = fj_self();
+    fj_landed();
+    if (w->syncing) {
+        struct fj_task *t = w->syncing;
+        w->syncing = NULL;
+        if (__atomic_sub_fetch(&t->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            __atomic_store_n(&t->pending, 1, __ATOMIC_RELEASE);
+            fj_resume(w, t);
+        }
+    }
+    while (!__atomic_load_n(&w->pool->done, __ATOMIC_ACQUIRE)) {
+        struct fj_task *t = deque_pop(w);
+        if (t || (t = fj_steal(w)) != NULL)
+            fj_resume(w, t);
+        sched_yield();
+    }
+}
+
+static void *fj_thread(void *arg)
+{
+    fj_worker = arg;
+    fj_loop(NULL);
+    fj_worker = NULL;
+    return NULL;
+}
+
+uint64_t co_fj_run(int workers, void (*root)(void *), void *arg)
+{
+    struct fj_pool pool;
+    uint64_t steals = 0;
+
+    assert(workers > 0 && fj_self() == NULL);
+    pool.num = workers;
+    pool.done = 0;
+    pool.workers = calloc(workers, sizeof(struct fj_worker));
+    assert(pool.workers != NULL);
+    for (int i = 0; i < workers; ++i) {
+        pool.workers[i].pool = &pool;
+        pool.workers[i].idx = i;
+        pool.workers[i].seed = i + 1;
+    }
+
+    // 调用者自己是 0 号 worker, 负责运行 root
+    for (int i = 1; i < workers; ++i)
+        pthread_create(&pool.workers[i].thread, NULL, fj_thread, &pool.workers[i]);
+    fj_worker = &pool.workers[0];
+    fj_loop(task_alloc(root, arg, NULL));
+    fj_worker = NULL;
+
+    for (int i = 0; i < workers; ++i) {
+        struct fj_worker *w = &pool.workers[i];
+        if (i > 0)
+            pthread_join(w->thread, NULL);
+        steals += w->steals;
+    }
+    free(pool.workers);
+    return steals;
+}
+
+int co_fj_worker(void)
+{
+    struct fj_worker *w = fj_self();
+    return w ? w->idx : -1;
+}
+
+// ----------------------------------------------------------------
+// 并行循环: 区间对半切分, 左半 co_fork, 右半自己接着切;
+// 没被偷时按顺序执行, 被偷走的总是最大的那一块
+// ----------------------------------------------------------------
+
+static int fj_default_workers(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// grain 为 0 时每个 worker 约分到 8 块
+static long fj_grain(long n, long grain)
+{
+    if (grain > 0)
+        return grain;
+    int workers = co_fj_worker() >= 0 ? fj_self()->pool->num : fj_default_workers();
+    grain = n / (8L * workers);
+    return grain > 0 ? grain : 1;
+}
+
+struct pfor {
+    long begin, end, grain;
+    void (*fn)(long begin, long end, void *ctx);
+    void *ctx;
+};
+
+static void pfor_task(void *arg)
+{
+    struct pfor *p = arg;
+    if (p->end - p->begin <= p->grain) {
+        p->fn(p->begin, p->end, p->ctx);
+        return;
+    }
+    struct pfor left = *p, right = *p;
+    left.end = right.begin = p->begin + (p->end - p->begin) / 2;
+    co_fork(pfor_task, &left);
+    pfor_task(&right);
+    co_sync();
+}
+
+void co_parallel_for(long begin, long end, long grain,
+                     void (*fn)(long begin, long end, void *ctx), void *ctx)
+{
+    struct pfor p = { begin, end, 0, fn, ctx };
+
+    if (begin >= end)
+        return;
+    p.grain = fj_grain(end - begin, grain);
+    if (co_fj_worker() >= 0)
+        pfor_task(&p);
+    else
+        co_fj_run(fj_default_workers(), pfor_task, &p);
+}
+
+struct preduce {
+    long begin, end, grain;
+    size_t size;
+    void (*init)(void *acc, void *ctx);
+    void (*map)(long begin, long end, void *acc, void *ctx);
+    void (*combine)(void *acc, const void *other, void *ctx);
+    void *ctx;
+    void *acc;
+};
+
+static void preduce_task(void *arg)
+{
+    struct preduce *p = arg;
+    if (p->end - p->begin <= p->grain) {
+        p->map(p->begin, p->end, p->acc, p->ctx);
+        return;
+    }
+    // 左半直接累加进 p->acc, 右半用临时的累加器, 最后按左右顺序合并
+    // 会被当作用户的累加器类型访问, 按最严格的基本类型对齐
+    _Alignas(max_align_t) uint8_t buf[p->size];
+    struct preduce left = *p, right = *p;
+    left.end = right.begin = p->begin + (p->end - p->begin) / 2;
+    right.acc = buf;
+    p->init(buf, p->ctx);
+    co_fork(preduce_task, &left);
+    preduce_task(&right);
+    co_sync();
+    p->combine(p->acc, buf, p->ctx);
+}
+
+void co_parallel_reduce(long begin, long end, long grain, void *acc, size_t size,
+                        void (*init)(void *acc, void *ctx),
+                        void (*map)(long begin, long end, void *acc, void *ctx),
+                        void (*combine)(void *acc, const void *other, void *ctx), void *ctx)
+{
+    struct preduce p = { begin, end, 0, size, init, map, combine, ctx, acc };
+
+    assert(size > 0 && size <= FJ_REDUCE_MAX);
+    if (begin >= end)
+        return;
+    p.grain = fj_grain(end - begin, grain);
+    if (co_fj_worker() >= 0)
+        preduce_task(&p);
+    else
+        co_fj_run(fj_default_workers(), preduce_task, &p);
+}
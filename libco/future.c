@@ -0,0 +1,50 @@
+#include "co.h"
+#include <assert.h>
+#include <string.h>
+
+void co_future_init(struct co_future *f)
+{
+    f->ready = 0;
+    f->size = 0;
+    co_list_init(&f->waiters);
+}
+
+void co_promise_set(struct co_future *f, const void *value, size_t size)
+{
+    assert(!f->ready && size <= CO_FUTURE_INLINE);
+    if (size)
+        memcpy(f->value.bytes, value, size);
+    f->size = size;
+    f->ready = 1;
+    // co_ready 会把节点从 waiters 中摘下
+    while (!co_list_empty(&f->waiters))
+        co_ready(co_list_entry(f->waiters.next, struct co_node, link));
+}
+
+void co_future_then(struct co_future *f, struct co_node *node)
+{
+    if (f->ready)
+        co_ready(node);
+    else
+        co_list_add_tail(&node->link, &f->waiters);
+}
+
+void *co_future_get_until(struct co_future *f, uint64_t deadline)
+{
+    if (!f->ready) {
+        struct co_node node;
+        co_node_init(&node, NULL);
+        co_list_add_tail(&node.link, &f->waiters);
+        co_park_until(&node, deadline);
+        if (!f->ready) {
+            co_list_del(&node.link);
+            return NULL;
+        }
+    }
+    return f->value.bytes;
+}
+
+void *co_future_get(struct co_future *f)
+{
+    return co_future_get_until(f, CO_FOREVER);
+}
@@ -0,0 +1,133 @@
+#include "co.h"
+#include "arch.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// 协程名字的驻留表: 相同内容的名字得到同一个编号, 编号 0 表示没有名字
+// 开放寻址的哈希表, 槽里存编号; 驻留的副本按编号放在只追加的分块数组里.
+// 各线程的调度器共用这张表, 插入和查找要加锁; 分块一旦分配就不再移动,
+// 所以按编号取名字 (co_name_of) 不用加锁
+
+#define CHUNK_SHIFT 6  // 第 k 块有 64 << k 个编号
+#define CHUNKS      26 // 足够放下全部 32 位编号
+
+static struct {
+    char **chunks[CHUNKS];
+    uint32_t num;     // 已分配的编号数, 发布时用 release 写
+    uint32_t *slots;  // 0 表示空槽
+    uint32_t mask;
+} table;
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 每个线程按调用者传入的指针缓存最近的结果, 字符串常量作名字时不用加锁也不用算哈希;
+// 同一个缓冲区可能先后放着不同的名字, 所以命中后还要比较一次内容
+#define CACHE_SIZE 64
+
+static __thread struct {
+    const char *key;
+    const char *name;
+    uint32_t id;
+} cache[CACHE_SIZE];
+
+static uint32_t hash(const char *s)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    while (*s)
+        h = (h ^ (uint8_t)*s++) * 16777619u;
+    return h;
+}
+
+static char **name_slot(uint32_t id)
+{
+    uint32_t x = (id >> CHUNK_SHIFT) + 1;
+    int k = 31 - __builtin_clz(x);
+    return &table.chunks[k][id - (((1u << k) - 1) << CHUNK_SHIFT)];
+}
+
+static void rehash(void)
+{
+    uint32_t size = table.slots ? (table.mask + 1) * 2 : 64;
+    uint32_t *slots = calloc(size, sizeof(uint32_t));
+    assert(slots != NULL);
+    for (uint32_t id = 1; id < table.num; id++) {
+        uint32_t i = hash(*name_slot(id)) & (size - 1);
+        while (slots[i])
+            i = (i + 1) & (size - 1);
+        slots[i] = id;
+    }
+    free(table.slots);
+    table.slots = slots;
+    table.mask = size - 1;
+}
+
+static uint32_t intern_locked(const char *name, const char **interned)
+{
+    if (table.num == 0)
+        table.num = 1; // 编号 0 保留
+    if (!table.slots || (table.num + 1) * 2 > table.mask + 1)
+        rehash();
+
+    uint32_t i = hash(name) & table.mask;
+    for (; table.slots[i]; i = (i + 1) & table.mask) {
+        const char *s = *name_slot(table.slots[i]);
+        if (strcmp(s, name) == 0) {
+            *interned = s;
+            return table.slots[i];
+        }
+    }
+
+    uint32_t id = table.num;
+    uint32_t x = (id >> CHUNK_SHIFT) + 1;
+    int k = 31 - __builtin_clz(x);
+    if (!table.chunks[k]) {
+        table.chunks[k] = malloc(((size_t)1 << (k + CHUNK_SHIFT)) * sizeof(char *));
+        assert(table.chunks[k] != NULL);
+    }
+    char *copy = strdup(name);
+    assert(copy != NULL);
+    *name_slot(id) = copy;
+    table.slots[i] = id;
+    // 副本和分块都写好了才让 co_name_of 看到这个编号
+    __atomic_store_n(&table.num, id + 1, __ATOMIC_RELEASE);
+    *interned = copy;
+    return id;
+}
+
+uint32_t co_intern_name(const char *name, const char **interned)
+{
+    if (name == NULL) {
+        *interned = NULL;
+        return 0;
+    }
+
+    uint32_t h = (uint32_t)((uintptr_t)name >> 3) * 2654435769u;
+    int c = h >> (32 - 6); // CACHE_SIZE == 64
+    if (cache[c].key == name && strcmp(cache[c].name, name) == 0) {
+        *interned = cache[c].name;
+        return cache[c].id;
+    }
+
+    pthread_mutex_lock(&table_lock);
+    uint32_t id = intern_locked(name, interned);
+    pthread_mutex_unlock(&table_lock);
+    cache[c].key = name;
+    cache[c].name = *interned;
+    cache[c].id = id;
+    return id;
+}
+
+uint32_t co_intern(const char *name)
+{
+    const char *interned;
+    return co_intern_name(name, &interned);
+}
+
+const char *co_name_of(uint32_t name_id)
+{
+    if (name_id == 0 || name_id >= __atomic_load_n(&table.num, __ATOMIC_ACQUIRE))
+        return NULL;
+    return *name_slot(name_id);
+}
@@ -0,0 +1,60 @@
+#include "co.h"
+#include <assert.h>
+
+struct co_mutex_waiter {
+    struct co_list link;
+    struct co_node node;
+    int acquired;
+};
+
+void co_mutex_init(struct co_mutex *m)
+{
+    m->owner = NULL;
+    co_list_init(&m->waiters);
+}
+
+int co_mutex_trylock(struct co_mutex *m)
+{
+    if (m->owner)
+        return -1;
+    m->owner = co_self();
+    return 0;
+}
+
+int co_mutex_lock_until(struct co_mutex *m, uint64_t deadline)
+{
+    struct co_mutex_waiter w;
+
+    if (co_mutex_trylock(m) == 0)
+        return 0;
+    assert(m->owner != co_self());
+    co_node_init(&w.node, NULL);
+    w.acquired = 0;
+    co_list_add_tail(&w.link, &m->waiters);
+    co_park_until(&w.node, deadline);
+    if (!w.acquired) {
+        co_list_del(&w.link);
+        return CO_TIMEDOUT;
+    }
+    return 0;
+}
+
+void co_mutex_lock(struct co_mutex *m)
+{
+    co_mutex_lock_until(m, CO_FOREVER);
+}
+
+void co_mutex_unlock(struct co_mutex *m)
+{
+    assert(m->owner == co_self());
+    m->owner = NULL;
+    if (co_list_empty(&m->waiters))
+        return;
+
+    // 直接交给队首, 避免被刚好来加锁的协程插队导致饥饿
+    struct co_mutex_waiter *w = co_list_entry(m->waiters.next, struct co_mutex_waiter, link);
+    co_list_del(&w->link);
+    w->acquired = 1;
+    m->owner = w->node.co;
+    co_ready(&w->node);
+}
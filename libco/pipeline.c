@@ -0,0 +1,204 @@
+#include "co.h"
+#include <assert.h>
+#include <stdlib.h>
+
+// 相邻两个阶段之间的连接: 固定数量的批在 free 和 full 两个通道之间循环,
+// 上游从 free 取空批装满后放进 full, 下游处理完再还回 free. 空批取完时上游挂起, 即背压
+struct pipe_link {
+    struct chan *full, *free;
+    int producers;        // 还没结束的上游协程数, 减到 0 时关闭 full
+    struct co_batch *mem; // 全部的批, 一次分配
+};
+
+struct co_batch {
+    int n;
+    void *items[];
+};
+
+struct co_emit {
+    struct co_pipeline *p;
+    struct pipe_link *link; // 最后一个阶段为 NULL
+    struct co_batch *batch; // 正在装的批
+};
+
+struct pipe_stage {
+    const char *name;
+    void (*fn)(void *item, struct co_emit *out, void *ctx);
+    void *ctx;
+    int workers;
+    struct pipe_link *in, *out;
+};
+
+struct pipe_worker {
+    struct pipe_stage *stage;
+    struct co_emit out;
+    struct co *co;
+};
+
+struct co_pipeline {
+    int batch, depth;
+    int num;
+    struct pipe_stage stages[CO_PIPELINE_MAX];
+    struct pipe_link links[CO_PIPELINE_MAX];
+    struct pipe_worker *workers;
+    int worker_num;
+    struct co_emit source;
+};
+
+struct co_pipeline *co_pipeline_new(int batch, int depth)
+{
+    assert(batch > 0 && depth > 0);
+    struct co_pipeline *p = calloc(1, sizeof(struct co_pipeline));
+    if (!p)
+        return NULL;
+    p->batch = batch;
+    p->depth = depth;
+    return p;
+}
+
+int co_pipeline_stage(struct co_pipeline *p, const char *name,
+                      void (*fn)(void *item, struct co_emit *out, void *ctx), void *ctx, int workers)
+{
+    assert(workers > 0 && p->workers == NULL);
+    if (p->num == CO_PIPELINE_MAX)
+        return -1;
+    p->stages[p->num++] = (struct pipe_stage){ name, fn, ctx, workers, NULL, NULL };
+    return 0;
+}
+
+static size_t batch_size(struct co_pipeline *p)
+{
+    return sizeof(struct co_batch) + p->batch * sizeof(void *);
+}
+
+static int link_init(struct co_pipeline *p, struct pipe_link *l, int producers, int consumers)
+{
+    // 每个上游、下游协程手里各有一批时, 仍然能有 depth 批排队
+    int num = p->depth + producers + consumers;
+    size_t size = batch_size(p);
+
+    l->producers = producers;
+    l->full = chan_new(num);
+    l->free = chan_new(num);
+    l->mem = malloc(num * size);
+    if (!l->full || !l->free || !l->mem)
+        return -1;
+    for (int i = 0; i < num; ++i) {
+        struct co_batch *b = (struct co_batch *)((char *)l->mem + i * size);
+        b->n = 0;
+        chan_send(l->free, b); // 容量足够, 不会挂起
+    }
+    return 0;
+}
+
+static void link_free(struct pipe_link *l)
+{
+    struct co_batch *b;
+    if (l->free) {
+        chan_close(l->free);
+        while (chan_recv(l->free, (void **)&b) == 0)
+            ;
+        chan_free(l->free);
+    }
+    if (l->full)
+        chan_free(l->full);
+    free(l->mem);
+}
+
+void co_pipeline_emit(struct co_emit *out, void *item)
+{
+    assert(out->link != NULL); // 最后一个阶段没有下游
+    if (!out->batch)
+        chan_recv(out->link->free, (void **)&out->batch);
+    out->batch->items[out->batch->n++] = item;
+    if (out->batch->n == out->p->batch) {
+        chan_send(out->link->full, out->batch);
+        out->batch = NULL;
+    }
+}
+
+static void emit_flush(struct co_emit *out)
+{
+    if (!out->batch)
+        return;
+    chan_send(out->batch->n > 0 ? out->link->full : out->link->free, out->batch);
+    out->batch = NULL;
+}
+
+static void emit_close(struct co_emit *out)
+{
+    if (!out->link)
+        return;
+    emit_flush(out);
+    if (--out->link->producers == 0)
+        chan_close(out->link->full);
+}
+
+static void stage_worker(void *arg)
+{
+    struct pipe_worker *w = arg;
+    struct pipe_stage *s = w->stage;
+    struct co_batch *b;
+
+    while (chan_recv(s->in->full, (void **)&b) == 0) {
+        for (int i = 0; i < b->n; ++i)
+            s->fn(b->items[i], &w->out, s->ctx);
+        b->n = 0;
+        chan_send(s->in->free, b);
+        // 每处理完一批就交出已有的输出, 免得上游断流时结果卡在半满的批里
+        if (w->out.link)
+            emit_flush(&w->out);
+    }
+    emit_close(&w->out);
+}
+
+int co_pipeline_start(struct co_pipeline *p)
+{
+    assert(p->num > 0 && p->workers == NULL);
+    for (int i = 0; i < p->num; ++i)
+        p->worker_num += p->stages[i].workers;
+    p->workers = calloc(p->worker_num, sizeof(struct pipe_worker));
+    if (!p->workers)
+        return -1;
+
+    // links[i] 连接第 i 个阶段的上游: 0 号的上游是 co_pipeline_push 的调用者
+    for (int i = 0; i < p->num; ++i) {
+        int producers = i == 0 ? 1 : p->stages[i - 1].workers;
+        if (link_init(p, &p->links[i], producers, p->stages[i].workers) < 0)
+            return -1;
+        p->stages[i].in = &p->links[i];
+        p->stages[i].out = i + 1 < p->num ? &p->links[i + 1] : NULL;
+    }
+    p->source = (struct co_emit){ p, &p->links[0], NULL };
+
+    struct pipe_worker *w = p->workers;
+    for (int i = 0; i < p->num; ++i) {
+        for (int j = 0; j < p->stages[i].workers; ++j, ++w) {
+            w->stage = &p->stages[i];
+            w->out = (struct co_emit){ p, p->stages[i].out, NULL };
+            w->co = co_start(p->stages[i].name, stage_worker, w);
+            if (!w->co)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+void co_pipeline_push(struct co_pipeline *p, void *item)
+{
+    co_pipeline_emit(&p->source, item);
+}
+
+void co_pipeline_finish(struct co_pipeline *p)
+{
+    if (p->workers) {
+        emit_close(&p->source);
+        for (int i = 0; i < p->worker_num; ++i)
+            if (p->workers[i].co)
+                co_wait(p->workers[i].co);
+        free(p->workers);
+    }
+    for (int i = 0; i < p->num; ++i)
+        link_free(&p->links[i]);
+    free(p);
+}
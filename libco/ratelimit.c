@@ -0,0 +1,113 @@
+#include "co.h"
+#include <assert.h>
+
+// 令牌以 1e-9 个为单位计数, 这样每纳秒恰好增加 rate 个单位, 不用浮点数
+#define TOKEN 1000000000ULL
+
+struct rl_waiter {
+    struct co_list link;
+    struct co_node node;
+    uint64_t n;
+    int granted;
+};
+
+static void rl_refill(struct co_ratelimit *rl, uint64_t now)
+{
+    uint64_t cap = rl->burst * TOKEN;
+    uint64_t elapsed = now - rl->last;
+
+    rl->last = now;
+    // 先截断, 避免乘法溢出
+    if (elapsed >= (cap - rl->tokens) / rl->rate + 1)
+        rl->tokens = cap;
+    else
+        rl->tokens += elapsed * rl->rate;
+}
+
+static struct rl_waiter *rl_head(struct co_ratelimit *rl)
+{
+    if (co_list_empty(&rl->waiters))
+        return NULL;
+    return co_list_entry(rl->waiters.next, struct rl_waiter, link);
+}
+
+// 按到达顺序放行令牌足够的等待者, 然后为新的队首定好时
+static void rl_dispatch(struct co_ratelimit *rl)
+{
+    struct rl_waiter *w;
+    uint64_t now = co_now();
+
+    rl_refill(rl, now);
+    while ((w = rl_head(rl)) != NULL && rl->tokens >= w->n * TOKEN) {
+        rl->tokens -= w->n * TOKEN;
+        co_list_del(&w->link);
+        w->granted = 1;
+        co_ready(&w->node);
+    }
+    if (w) {
+        uint64_t need = w->n * TOKEN - rl->tokens;
+        co_timer_start(&rl->timer, now + (need + rl->rate - 1) / rl->rate, &rl->timer_node);
+    } else {
+        co_timer_cancel(&rl->timer);
+    }
+}
+
+static void rl_fire(struct co_node *node)
+{
+    rl_dispatch(co_list_entry(node, struct co_ratelimit, timer_node));
+}
+
+void co_ratelimit_init(struct co_ratelimit *rl, uint64_t rate, uint64_t burst)
+{
+    assert(rate > 0 && burst > 0);
+    rl->rate = rate;
+    rl->burst = burst;
+    rl->tokens = burst * TOKEN;
+    rl->last = co_now();
+    co_list_init(&rl->waiters);
+    co_timer_init(&rl->timer);
+    co_node_init(&rl->timer_node, rl_fire);
+}
+
+int co_ratelimit_try_acquire(struct co_ratelimit *rl, uint64_t n)
+{
+    // 有人在排队时不插队
+    if (!co_list_empty(&rl->waiters))
+        return -1;
+    rl_refill(rl, co_now());
+    if (rl->tokens < n * TOKEN)
+        return -1;
+    rl->tokens -= n * TOKEN;
+    return 0;
+}
+
+int co_ratelimit_acquire_until(struct co_ratelimit *rl, uint64_t n, uint64_t deadline)
+{
+    struct rl_waiter w;
+
+    assert(n <= rl->burst);
+    if (co_ratelimit_try_acquire(rl, n) == 0)
+        return 0;
+
+    co_node_init(&w.node, NULL);
+    w.n = n;
+    w.granted = 0;
+    co_list_add_tail(&w.link, &rl->waiters);
+    if (rl_head(rl) == &w)
+        rl_dispatch(rl);
+    co_park_until(&w.node, deadline);
+    if (!w.granted) {
+        // 队首走了, 后面的可能已经够了
+        int was_head = rl_head(rl) == &w;
+        co_list_del(&w.link);
+        if (was_head)
+            rl_dispatch(rl);
+        return CO_TIMEDOUT;
+    }
+    return 0;
+}
+
+int co_ratelimit_acquire(struct co_ratelimit *rl, uint64_t n)
+{
+    return co_ratelimit_acquire_until(rl, n, CO_FOREVER);
+}
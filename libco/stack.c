@@ -0,0 +1,216 @@
+#include "arch.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+// 栈池: 按 2 的幂分大小类, 每个线程每类有两个弹匣 (loaded, prev), 后进先出,
+// 所以复用的总是最近释放的栈, 栈顶的几页多半还在缓存和 TLB 里.
+// 弹匣满了整个交给全局仓库, 空了从仓库整个取一个, 线程间只在这时加锁
+
+#ifndef CO_NO_STACK_POOL
+
+#define MIN_SHIFT   12 // 4KiB
+#define CLASSES     13 // 到 16MiB
+#define MAG_SIZE    16
+#define DEPOT_MAX   16 // 仓库每类最多保留的满弹匣数, 多了直接释放
+
+struct magazine {
+    struct magazine *next;
+    int num;
+    void *stacks[MAG_SIZE];
+};
+
+struct stack_cache {
+    struct magazine *loaded, *prev;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct magazine *full[CLASSES];
+    int full_num[CLASSES];
+    struct magazine *empty; // 空弹匣也留着, 省得反复 malloc
+} depot = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct stack_cache caches[CLASSES];
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static __thread int cache_registered;
+
+static int size_class(size_t size)
+{
+    int c = 0;
+    while (((size_t)1 << (MIN_SHIFT + c)) < size)
+        c++;
+    return c;
+}
+
+static struct magazine *mag_new(void)
+{
+    struct magazine *m;
+
+    pthread_mutex_lock(&depot.lock);
+    if ((m = depot.empty) != NULL)
+        depot.empty = m->next;
+    pthread_mutex_unlock(&depot.lock);
+    if (!m && !(m = malloc(sizeof(struct magazine))))
+        return NULL;
+    m->num = 0;
+    return m;
+}
+
+static void mag_free(struct magazine *m)
+{
+    pthread_mutex_lock(&depot.lock);
+    m->next = depot.empty;
+    depot.empty = m;
+    pthread_mutex_unlock(&depot.lock);
+}
+
+// 把满弹匣交给仓库, 仓库已经够多时释放其中的栈
+static void depot_put_full(int c, struct magazine *m)
+{
+    pthread_mutex_lock(&depot.lock);
+    if (depot.full_num[c] < DEPOT_MAX) {
+        m->next = depot.full[c];
+        depot.full[c] = m;
+        depot.full_num[c]++;
+        m = NULL;
+    }
+    pthread_mutex_unlock(&depot.lock);
+    if (m) {
+        while (m->num > 0)
+            free(m->stacks[--m->num]);
+        mag_free(m);
+    }
+}
+
+static struct magazine *depot_get_full(int c)
+{
+    struct magazine *m;
+
+    pthread_mutex_lock(&depot.lock);
+    if ((m = depot.full[c]) != NULL) {
+        depot.full[c] = m->next;
+        depot.full_num[c]--;
+    }
+    pthread_mutex_unlock(&depot.lock);
+    return m;
+}
+
+// 不满的弹匣不进仓库 (仓库里的弹匣都是满的), 里面的栈直接释放
+static void mag_drain(int c, struct magazine *m)
+{
+    if (m->num == MAG_SIZE) {
+        depot_put_full(c, m);
+        return;
+    }
+    while (m->num > 0)
+        free(m->stacks[--m->num]);
+    mag_free(m);
+}
+
+// 线程退出时把弹匣里的栈还给仓库: 先用 prev 把 loaded 补满, 凑不满的释放
+static void cache_flush(void *arg)
+{
+    for (int c = 0; c < CLASSES; ++c) {
+        struct magazine *a = caches[c].loaded, *b = caches[c].prev;
+        while (a && b && b->num > 0 && a->num < MAG_SIZE)
+            a->stacks[a->num++] = b->stacks[--b->num];
+        if (a)
+            mag_drain(c, a);
+        if (b)
+            mag_drain(c, b);
+        caches[c].loaded = caches[c].prev = NULL;
+    }
+    // 之后的线程局部析构 (比如回收默认调度器) 还可能往栈池里放栈, 到时重新登记
+    cache_registered = 0;
+}
+
+static void cache_key_init(void)
+{
+    pthread_key_create(&cache_key, cache_flush);
+}
+
+// 线程第一次拿到弹匣时登记, 退出时才会调用 cache_flush;
+// 只从仓库取过弹匣的线程也要登记, 否则这些栈就随线程一起丢了
+static inline void cache_register(void)
+{
+    if (cache_registered)
+        return;
+    pthread_once(&cache_once, cache_key_init);
+    pthread_setspecific(cache_key, caches); // 非 NULL 才会在线程退出时调用 cache_flush
+    cache_registered = 1;
+}
+
+void *co_stack_get(size_t size)
+{
+    int c = size_class(size);
+    struct stack_cache *cache = &caches[c];
+    struct magazine *m;
+
+    assert(c < CLASSES);
+    if (cache->loaded && cache->loaded->num > 0)
+        return cache->loaded->stacks[--cache->loaded->num];
+    if (cache->prev && cache->prev->num > 0) {
+        m = cache->prev;
+        cache->prev = cache->loaded;
+        cache->loaded = m;
+        return m->stacks[--m->num];
+    }
+    if ((m = depot_get_full(c)) != NULL) {
+        cache_register();
+        // 两个空弹匣留一个
+        if (cache->prev)
+            mag_free(cache->prev);
+        cache->prev = cache->loaded;
+        cache->loaded = m;
+        return m->stacks[--m->num];
+    }
+    return malloc((size_t)1 << (MIN_SHIFT + c));
+}
+
+void co_stack_put(void *stack, size_t size)
+{
+    int c = size_class(size);
+    struct stack_cache *cache = &caches[c];
+    struct magazine *m;
+
+    if (!stack)
+        return;
+    if (cache->loaded && cache->loaded->num < MAG_SIZE) {
+        cache->loaded->stacks[cache->loaded->num++] = stack;
+        return;
+    }
+    cache_register();
+    // loaded 满了: prev 还有空位就换过来接着放, 只有满的 prev 才交给仓库
+    if (cache->prev && cache->prev->num < MAG_SIZE) {
+        m = cache->prev;
+        cache->prev = cache->loaded;
+        cache->loaded = m;
+        m->stacks[m->num++] = stack;
+        return;
+    }
+    if (!(m = mag_new())) {
+        free(stack);
+        return;
+    }
+    if (cache->prev)
+        depot_put_full(c, cache->prev);
+    cache->prev = cache->loaded;
+    cache->loaded = m;
+    m->stacks[m->num++] = stack;
+}
+
+#else
+
+void *co_stack_get(size_t size)
+{
+    return malloc(size);
+}
+
+void co_stack_put(void *stack, size_t size)
+{
+    free(stack);
+}
+
+#endif
@@ -1,7 +1,13 @@
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include "co-test.h"
 
 int g_count = 0;
@@ -129,6 +135,1079 @@ static void test_2()
     q_free(queue);
 }
 
+// -----------------------------------------------
+
+static int g_sum = 0;
+
+struct produce_args {
+    struct chan *ch;
+    int from, to;
+};
+
+static void chan_producer(void *arg)
+{
+    // 参数是 co_start_args 复制到协程栈上的, 不需要 free
+    struct produce_args *args = (struct produce_args *)arg;
+    for (int i = args->from; i <= args->to; ++i) {
+        int ret = chan_send(args->ch, (void *)(intptr_t)i);
+        assert(ret == 0);
+    }
+}
+
+static void chan_consumer(void *arg)
+{
+    struct chan *ch = (struct chan *)arg;
+    void *item;
+    while (chan_recv(ch, &item) == 0)
+        g_sum += (int)(intptr_t)item;
+}
+
+static int g_pipe[2];
+
+static void pipe_writer(void *arg)
+{
+    co_sleep(1000000);
+    int ret = write(g_pipe[1], "x", 1);
+    assert(ret == 1);
+}
+
+static void pipe_reader(void *arg)
+{
+    char c;
+    uint64_t start = co_now();
+    assert(co_wait_io(g_pipe[0], POLLIN) & POLLIN);
+    assert(read(g_pipe[0], &c, 1) == 1 && c == 'x');
+    assert(co_now() - start >= 1000000);
+    printf("pipe ok  ");
+}
+
+static void test_3()
+{
+    struct chan *ch = chan_new(4);
+
+    struct produce_args args = { ch, 1, 100 };
+    struct co *thd1 = co_start_args("producer-1", chan_producer, &args);
+    args.from = 101, args.to = 200;
+    struct co *thd2 = co_start_args("producer-2", chan_producer, &args);
+    struct co *thd3 = co_start("consumer-1", chan_consumer, ch);
+    struct co *thd4 = co_start("consumer-2", chan_consumer, ch);
+
+    co_wait(thd1);
+    co_wait(thd2);
+    chan_close(ch);
+    co_wait(thd3);
+    co_wait(thd4);
+    chan_free(ch);
+    printf("sum = %d  ", g_sum);
+    assert(g_sum == 20100);
+
+    assert(pipe(g_pipe) == 0);
+    struct co *thd5 = co_start("reader", pipe_reader, NULL);
+    struct co *thd6 = co_start("writer", pipe_writer, NULL);
+    co_wait(thd5);
+    co_wait(thd6);
+    close(g_pipe[0]);
+    close(g_pipe[1]);
+}
+
+// -----------------------------------------------
+
+static void nop(void *arg)
+{
+}
+
+static int open_fds()
+{
+    DIR *d = opendir("/proc/self/fd");
+    int n = 0;
+    assert(d != NULL);
+    while (readdir(d))
+        n++;
+    closedir(d);
+    return n;
+}
+
+// 多个线程同时驻留各自的名字, 驻留表会在此期间扩容
+static void *intern_thread(void *arg)
+{
+    char name[32];
+    for (int i = 0; i < 2000; ++i) {
+        snprintf(name, sizeof(name), "t%d-%d", (int)(intptr_t)arg, i);
+        struct co *co = co_start(name, nop, NULL);
+        assert(strcmp(co_name_of(co_name_id(co)), name) == 0);
+        co_wait(co);
+    }
+    return NULL;
+}
+
+static void test_4()
+{
+    struct co *a = co_start("worker", nop, NULL);
+    struct co *b = co_start("worker", nop, NULL);
+    char name[] = "worker";
+    struct co *c = co_start(name, nop, NULL);
+    struct co *d = co_start("other", nop, NULL);
+
+    assert(co_id(a) < co_id(b) && co_id(b) < co_id(c) && co_id(c) < co_id(d));
+    assert(co_name_id(a) == co_name_id(b) && co_name_id(b) == co_name_id(c));
+    assert(co_name_id(a) != co_name_id(d));
+    assert(co_name_id(a) == co_intern("worker"));
+    assert(strcmp(co_name_of(co_name_id(d)), "other") == 0);
+    assert(co_name_of(co_intern(NULL)) == NULL);
+
+    // 线程退出时回收各自的默认调度器, 不留下 eventfd
+    int fds = open_fds();
+    pthread_t tids[4];
+    for (int i = 0; i < 4; ++i)
+        assert(pthread_create(&tids[i], NULL, intern_thread, (void *)(intptr_t)i) == 0);
+    for (int i = 0; i < 4; ++i)
+        pthread_join(tids[i], NULL);
+    assert(open_fds() == fds);
+    assert(co_intern("t3-1999") == co_intern("t3-1999"));
+    printf("ids ok");
+
+    co_wait(a);
+    co_wait(b);
+    co_wait(c);
+    co_wait(d);
+}
+
+// -----------------------------------------------
+
+static void sched_worker(void *arg)
+{
+    int *count = (int *)arg;
+    for (int i = 0; i < 10; ++i) {
+        (*count)++;
+        co_yield ();
+    }
+}
+
+static void sched_spawner(void *arg)
+{
+    // 在 co_sched_run 中 co_start 作用于正在运行的调度器
+    int *count = (int *)arg;
+    co_start("worker", sched_worker, count);
+    co_start("worker", sched_worker, count);
+}
+
+// 在另一个调度器中取消默认调度器上的定时器, 同时自己也用定时器
+static void foreign_cancel(void *arg)
+{
+    struct co_timer mine;
+    struct co_node node;
+
+    co_node_init(&node, NULL);
+    co_timer_init(&mine);
+    co_timer_start(&mine, co_now() + 1000000, &node);
+    co_timer_cancel((struct co_timer *)arg);
+    co_park();
+    assert(mine.idx < 0);
+}
+
+static void never_fires(struct co_node *node)
+{
+    assert(0);
+}
+
+static void test_5()
+{
+    co_sched_t *a = co_sched_create();
+    co_sched_t *b = co_sched_create();
+    int count_a = 0, count_b = 0;
+
+    co_sched_start(a, "spawner", sched_spawner, &count_a);
+    co_sched_start(b, "worker", sched_worker, &count_b);
+    assert(count_a == 0 && count_b == 0);
+
+    co_sched_run(a);
+    assert(count_a == 20 && count_b == 0);
+    co_sched_run(b);
+    assert(count_b == 10);
+
+    struct co_sched_stats sa, sb;
+    co_sched_get_stats(a, &sa);
+    co_sched_get_stats(b, &sb);
+    assert(sa.spawned == 3 && sb.spawned == 1);
+    assert(sa.switches > sb.switches);
+    assert(co_sched_self() != a && co_sched_self() != b);
+    printf("a: %d spawned, %d switches; b: %d spawned, %d switches",
+           (int)sa.spawned, (int)sa.switches, (int)sb.spawned, (int)sb.switches);
+
+    co_sched_destroy(a);
+    co_sched_destroy(b);
+
+    struct co_timer t;
+    struct co_node node;
+    co_sched_t *c = co_sched_create();
+    co_node_init(&node, never_fires);
+    co_timer_init(&t);
+    co_timer_start(&t, co_now() + 60 * 1000000000ull, &node);
+    co_sched_start(c, "cancel", foreign_cancel, &t);
+    co_sched_run(c);
+    assert(t.idx < 0 && co_next_timeout() == -1);
+    co_sched_destroy(c);
+}
+
+// -----------------------------------------------
+
+static int g_loop_done = 0;
+
+static void loop_reader(void *arg)
+{
+    int fd = *(int *)arg;
+    char c;
+    assert(co_wait_io(fd, POLLIN) & POLLIN);
+    assert(read(fd, &c, 1) == 1);
+    co_sleep(2000000);
+    g_loop_done = 1;
+}
+
+static void *late_writer(void *arg)
+{
+    usleep(2000);
+    assert(write(*(int *)arg, "z", 1) == 1);
+    return NULL;
+}
+
+static void test_6()
+{
+    // 外部的 epoll 循环驱动一个调度器; 没有定时器时只等 co_sched_fd, 不设超时
+    co_sched_t *s = co_sched_create();
+    int fds[2], iterations = 0;
+    pthread_t tid;
+    assert(pipe(fds) == 0);
+    co_sched_start(s, "reader", loop_reader, &fds[0]);
+
+    int ep = epoll_create1(0);
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = co_sched_fd(s) };
+    assert(epoll_ctl(ep, EPOLL_CTL_ADD, co_sched_fd(s), &ev) == 0);
+    assert(pthread_create(&tid, NULL, late_writer, &fds[1]) == 0);
+
+    for (;;) {
+        co_sched_run_once(s, 1000000);
+        if (g_loop_done)
+            break;
+        int64_t ns = co_sched_next_timeout(s);
+        epoll_wait(ep, &ev, 1, ns < 0 ? -1 : (int)((ns + 999999) / 1000000));
+        iterations++;
+    }
+    printf("loop done after %d iterations", iterations);
+    pthread_join(tid, NULL);
+
+    close(ep);
+    close(fds[0]);
+    close(fds[1]);
+    co_sched_run(s);
+
+    // 预算为 0 时每次调用也至少运行一轮
+    int count = 0, calls = 0;
+    co_sched_start(s, "worker", sched_worker, &count);
+    assert(co_sched_run_once(s, 0) == 1 && count == 1);
+    while (co_sched_run_once(s, 0))
+        calls++;
+    assert(count == 10 && calls < 10);
+    co_sched_destroy(s);
+}
+
+// -----------------------------------------------
+
+struct offload {
+    co_sched_t *sched;
+    struct co *co;
+    int input, output;
+};
+
+static void *offload_thread(void *arg)
+{
+    struct offload *job = (struct offload *)arg;
+    usleep(1000);
+    job->output = job->input * job->input;
+    co_post(job->sched, job->co);
+    return NULL;
+}
+
+static void offload_worker(void *arg)
+{
+    struct offload job = { co_sched_self(), co_self(), *(int *)arg, 0 };
+    pthread_t tid;
+
+    // 交给别的线程计算, 完成后由它 co_post 唤醒
+    assert(pthread_create(&tid, NULL, offload_thread, &job) == 0);
+    co_park();
+    assert(job.output == job.input * job.input);
+    g_sum += job.output;
+    pthread_join(tid, NULL);
+}
+
+static void test_7()
+{
+    struct co *thd[8];
+    int inputs[8];
+
+    g_sum = 0;
+    for (int i = 0; i < 8; ++i) {
+        inputs[i] = i + 1;
+        thd[i] = co_start("offload", offload_worker, &inputs[i]);
+    }
+    for (int i = 0; i < 8; ++i)
+        co_wait(thd[i]);
+    printf("sum = %d", g_sum);
+    assert(g_sum == 204);
+}
+
+// -----------------------------------------------
+
+static int g_fib_yields;
+
+static void fib_co(void *arg)
+{
+    int *n = arg;
+    if (*n < 2)
+        return;
+    int a = *n - 1, b = *n - 2;
+    struct co *left = co_start("fib", fib_co, &a);
+    struct co *right = co_start("fib", fib_co, &b);
+    // 内联执行的协程中途让出也不影响结果
+    if (*n % 5 == 0) {
+        g_fib_yields++;
+        co_yield ();
+    }
+    co_wait(left);
+    co_wait(right);
+    *n = a + b;
+}
+
+// 被内联执行时 co_post 创建者: 创建者的现场在本协程的栈帧下面, 唤醒要推迟到内联结束
+static struct co *g_inline_caller;
+static int g_inline_posted;
+
+static void post_caller(void *arg)
+{
+    co_post(co_sched_self(), g_inline_caller);
+    co_sleep(1000000);
+    g_inline_posted = 1;
+}
+
+static void inline_caller(void *arg)
+{
+    g_inline_caller = co_self();
+    struct co *child = co_start("post", post_caller, NULL);
+    co_wait(child);
+    assert(g_inline_posted == 1);
+    co_park(); // 消耗推迟的唤醒
+}
+
+static void test_8()
+{
+    co_sched_t *s = co_sched_create();
+    struct co_sched_stats stats;
+    int n = 20;
+
+    co_sched_set_inline(s, 1);
+    co_sched_start(s, "fib", fib_co, &n);
+    co_sched_run(s);
+    co_sched_get_stats(s, &stats);
+    printf("fib(20) = %d", n);
+    assert(n == 6765);
+    assert(g_fib_yields > 0);
+    // 创建者让出时, 就绪队列中还没开始的子协程会被调度器正常启动, 其余都被内联执行
+    assert(stats.inlined > 0 && stats.inlined < stats.spawned);
+    co_sched_destroy(s);
+
+    s = co_sched_create();
+    co_sched_set_inline(s, 1);
+    co_sched_start(s, "caller", inline_caller, NULL);
+    co_sched_run(s);
+    co_sched_get_stats(s, &stats);
+    assert(g_inline_posted == 1 && stats.inlined == 1);
+    co_sched_destroy(s);
+}
+
+// -----------------------------------------------
+
+static void sleeper(void *arg)
+{
+    co_sleep((uint64_t)(intptr_t)arg * 1000000);
+}
+
+static struct co *g_shared;
+static int g_joined;
+
+static void joiner(void *arg)
+{
+    co_wait(g_shared);
+    g_joined++;
+}
+
+static void test_9()
+{
+    // 三个协程同时等待同一个 worker
+    struct co *j[3];
+    g_shared = co_start("shared", sleeper, (void *)(intptr_t)5);
+    for (int i = 0; i < 3; ++i)
+        j[i] = co_start("joiner", joiner, NULL);
+    assert(co_wait_all(j, 3) == 0);
+    assert(g_joined == 3);
+
+    // 普通的 co_wait 与 co_wait_all/co_wait_any 等待同一个协程, 最后返回的负责回收
+    struct co *pair[2], *plain;
+    g_shared = pair[0] = co_start("shared", sleeper, (void *)(intptr_t)5);
+    pair[1] = co_start("sleeper", sleeper, (void *)(intptr_t)10);
+    plain = co_start("joiner", joiner, NULL);
+    assert(co_wait_all(pair, 2) == 0);
+    co_wait(plain);
+    g_shared = pair[0] = co_start("shared", sleeper, (void *)(intptr_t)5);
+    pair[1] = co_start("sleeper", sleeper, (void *)(intptr_t)10);
+    plain = co_start("joiner", joiner, NULL);
+    assert(co_wait_any(pair, 2) == 0);
+    co_wait(plain);
+    co_wait(pair[1]);
+    assert(g_joined == 5);
+
+    // 按结束的先后顺序收集
+    struct co *cos[4];
+    int delays[4] = {30, 10, 40, 20}, order[4];
+    for (int i = 0; i < 4; ++i)
+        cos[i] = co_start("sleeper", sleeper, (void *)(intptr_t)delays[i]);
+    for (int n = 4; n > 0; --n) {
+        int i = co_wait_any(cos, n);
+        order[4 - n] = delays[i];
+        cos[i] = cos[n - 1];
+        delays[i] = delays[n - 1];
+    }
+    for (int i = 0; i < 4; ++i)
+        printf("%d ", order[i]);
+    assert(order[0] == 10 && order[1] == 20 && order[2] == 30 && order[3] == 40);
+}
+
+// -----------------------------------------------
+
+static struct co_mutex g_mutex;
+
+static void mutex_holder(void *arg)
+{
+    co_mutex_lock(&g_mutex);
+    co_sleep(20 * 1000000);
+    co_mutex_unlock(&g_mutex);
+}
+
+static void test_10()
+{
+    const uint64_t ms = 1000000;
+    struct chan *ch = chan_new(0);
+    void *item;
+    int fds[2];
+
+    // 等一个还要很久才结束的协程, 超时后仍可以继续等
+    struct co *slow = co_start("slow", sleeper, (void *)(intptr_t)30);
+    assert(co_wait_timeout(slow, 5 * ms) == CO_TIMEDOUT);
+    assert(co_wait_timeout(slow, 100 * ms) == 0);
+
+    assert(chan_recv_until(ch, &item, co_now() + 5 * ms) == CO_TIMEDOUT);
+    assert(chan_send_until(ch, NULL, co_now() + 5 * ms) == CO_TIMEDOUT);
+    chan_free(ch);
+
+    co_mutex_init(&g_mutex);
+    struct co *holder = co_start("holder", mutex_holder, NULL);
+    assert(co_mutex_trylock(&g_mutex) == -1);
+    assert(co_mutex_lock_until(&g_mutex, co_now() + 5 * ms) == CO_TIMEDOUT);
+    assert(co_mutex_lock_until(&g_mutex, co_now() + 100 * ms) == 0);
+    co_mutex_unlock(&g_mutex);
+    co_wait(holder);
+
+    assert(pipe(fds) == 0);
+    uint64_t start = co_now();
+    assert(co_wait_io_until(fds[0], POLLIN, start + 5 * ms) == CO_TIMEDOUT);
+    assert(co_now() - start >= 5 * ms);
+    close(fds[0]);
+    close(fds[1]);
+    printf("timeouts ok");
+}
+
+// -----------------------------------------------
+
+struct pfib_args {
+    int n;
+    long result;
+};
+
+static void pfib(void *arg)
+{
+    struct pfib_args *a = arg;
+    if (a->n < 2) {
+        a->result = a->n;
+        return;
+    }
+    struct pfib_args x = { a->n - 1 }, y = { a->n - 2 };
+    co_fork(pfib, &x);
+    pfib(&y);
+    co_sync();
+    a->result = x.result + y.result;
+}
+
+struct psort_args {
+    int *a, n;
+};
+
+static void psort(void *arg)
+{
+    struct psort_args *p = arg;
+    int *a = p->a, n = p->n, i = 0, j = n - 1, pivot = a[n / 2];
+    if (n < 2)
+        return;
+    while (i <= j) {
+        while (a[i] < pivot)
+            i++;
+        while (a[j] > pivot)
+            j--;
+        if (i <= j) {
+            int t = a[i];
+            a[i++] = a[j];
+            a[j--] = t;
+        }
+    }
+    struct psort_args left = { a, j + 1 }, right = { a + i, n - i };
+    co_fork(psort, &left);
+    psort(&right);
+    // left 在本层的栈帧里, 返回前必须 co_sync: 子任务可能还没读它, 调用者就已经被偷走并返回了
+    co_sync();
+}
+
+static struct pfib_args g_fibs[32];
+
+static void fork_fibs(void *arg)
+{
+    // 参数不在栈上, 可以不显式 co_sync, 任务结束时隐式等待全部子任务
+    for (int i = 0; i < 32; ++i) {
+        g_fibs[i].n = 15;
+        co_fork(pfib, &g_fibs[i]);
+    }
+}
+
+static void test_11()
+{
+    for (int workers = 1; workers <= 4; workers *= 2) {
+        struct pfib_args fib = { 20 };
+        co_fj_run(workers, pfib, &fib);
+        printf("%ld ", fib.result);
+        assert(fib.result == 6765);
+    }
+
+    int n = 100000, *a = malloc(n * sizeof(int));
+    for (int i = 0; i < n; ++i)
+        a[i] = (int)((i * 2654435761u) % 1000003);
+    struct psort_args sort = { a, n };
+    co_fj_run(4, psort, &sort);
+    for (int i = 1; i < n; ++i)
+        assert(a[i - 1] <= a[i]);
+    free(a);
+
+    co_fj_run(4, fork_fibs, NULL);
+    for (int i = 0; i < 32; ++i)
+        assert(g_fibs[i].result == 610);
+    printf("sorted");
+}
+
+// -----------------------------------------------
+
+static void square_range(long begin, long end, void *ctx)
+{
+    long *a = ctx;
+    for (long i = begin; i < end; ++i)
+        a[i] = i * i;
+}
+
+// 累加器: 和, 以及第一个、最后一个元素 (检查合并的顺序)
+struct span_sum {
+    long sum, first, last;
+};
+
+static void span_init(void *acc, void *ctx)
+{
+    struct span_sum *s = acc;
+    assert((uintptr_t)acc % _Alignof(max_align_t) == 0); // 临时累加器也要对齐
+    s->sum = 0;
+    s->first = s->last = -1;
+}
+
+static void span_map(long begin, long end, void *acc, void *ctx)
+{
+    struct span_sum *s = acc;
+    long *a = ctx;
+    for (long i = begin; i < end; ++i) {
+        s->sum += a[i];
+        if (s->first < 0)
+            s->first = i;
+        assert(i > s->last);
+        s->last = i;
+    }
+}
+
+static void span_combine(void *acc, const void *other, void *ctx)
+{
+    struct span_sum *s = acc;
+    const struct span_sum *o = other;
+    if (o->first < 0)
+        return;
+    assert(o->first > s->last);
+    s->sum += o->sum;
+    if (s->first < 0)
+        s->first = o->first;
+    s->last = o->last;
+}
+
+struct reduce_args {
+    struct span_sum acc;
+    long *a;
+};
+
+static void reduce_root(void *arg)
+{
+    struct reduce_args *r = arg;
+    span_init(&r->acc, NULL);
+    co_parallel_reduce(0, 1000, 7, &r->acc, sizeof(r->acc), span_init, span_map, span_combine, r->a);
+}
+
+static void test_12()
+{
+    long n = 1000, *a = malloc(n * sizeof(long));
+    struct reduce_args r = { .a = a };
+
+    co_parallel_for(0, n, 0, square_range, a);
+    for (long i = 0; i < n; ++i)
+        assert(a[i] == i * i);
+
+    span_init(&r.acc, NULL);
+    co_parallel_reduce(0, n, 16, &r.acc, sizeof(r.acc), span_init, span_map, span_combine, a);
+    printf("%ld ", r.acc.sum);
+    assert(r.acc.sum == 332833500 && r.acc.first == 0 && r.acc.last == n - 1);
+
+    // 在 co_fj_run 中调用时不再新建 worker
+    co_fj_run(3, reduce_root, &r);
+    printf("%ld", r.acc.sum);
+    assert(r.acc.sum == 332833500 && r.acc.last == n - 1);
+    free(a);
+}
+
+// -----------------------------------------------
+
+static struct co_future g_answer, g_doubled;
+
+static void answer_later(void *arg)
+{
+    int v = 21;
+    co_sleep(2 * 1000000);
+    co_promise_set(&g_answer, &v, sizeof(v));
+}
+
+static void answer_reader(void *arg)
+{
+    *(int *)arg = *(int *)co_future_get(&g_answer);
+}
+
+// 回调: 不创建协程, 直接由调度器运行
+static void double_answer(struct co_node *node)
+{
+    int v = *(int *)g_answer.value.bytes * 2;
+    co_promise_set(&g_doubled, &v, sizeof(v));
+}
+
+static void test_13()
+{
+    struct co_sched_stats before, after;
+    struct co_node then;
+    int got[2] = {0, 0};
+
+    co_future_init(&g_answer);
+    co_future_init(&g_doubled);
+    co_node_init(&then, double_answer);
+    co_future_then(&g_answer, &then);
+    assert(co_future_get_until(&g_doubled, co_now() + 1000000) == NULL);
+
+    struct co *readers[2] = { co_start("reader", answer_reader, &got[0]), co_start("reader", answer_reader, &got[1]) };
+    co_sched_get_stats(co_sched_self(), &before);
+    struct co *writer = co_start("writer", answer_later, NULL);
+    int doubled = *(int *)co_future_get(&g_doubled);
+    co_sched_get_stats(co_sched_self(), &after);
+    assert(after.spawned == before.spawned + 1);
+    co_wait(writer);
+    co_wait_all(readers, 2);
+    printf("%d %d %d", got[0], got[1], doubled);
+    assert(got[0] == 21 && got[1] == 21 && doubled == 42);
+}
+
+// -----------------------------------------------
+
+struct session_msg {
+    int amount;
+    struct co *reply_to;
+};
+
+// 长期运行的会话: 收到的金额累加, 收到 0 时把总数回复给发送者并结束
+static void session(void *arg)
+{
+    struct session_msg *msg;
+    intptr_t total = 0;
+    while (co_recv((void **)&msg) == 0) {
+        if (msg->amount == 0) {
+            co_send(msg->reply_to, (void *)total);
+            break;
+        }
+        total += msg->amount;
+    }
+}
+
+static void test_14()
+{
+    struct session_msg msgs[101];
+    void *reply;
+
+    struct co *s = co_start("session", session, NULL);
+    co_mailbox_open(s, 4);
+    for (int i = 0; i <= 100; ++i) {
+        msgs[i].amount = i == 100 ? 0 : i + 1;
+        msgs[i].reply_to = co_self();
+        assert(co_send(s, &msgs[i]) == 0);
+    }
+    assert(co_recv(&reply) == 0);
+    printf("total = %ld", (long)(intptr_t)reply);
+    assert((intptr_t)reply == 5050);
+    co_wait(s);
+}
+
+// -----------------------------------------------
+
+static void stage_double(void *item, struct co_emit *out, void *ctx)
+{
+    co_pipeline_emit(out, (void *)((intptr_t)item * 2));
+}
+
+static void stage_filter(void *item, struct co_emit *out, void *ctx)
+{
+    if ((intptr_t)item % 3 == 0)
+        co_pipeline_emit(out, item);
+    if ((intptr_t)item % 7 == 0)
+        co_yield (); // 各个协程交错运行
+}
+
+static void stage_sum(void *item, struct co_emit *out, void *ctx)
+{
+    *(long *)ctx += (intptr_t)item;
+}
+
+static void test_15()
+{
+    long sum = 0;
+    struct co_pipeline *p = co_pipeline_new(8, 2);
+
+    co_pipeline_stage(p, "double", stage_double, NULL, 3);
+    co_pipeline_stage(p, "filter", stage_filter, NULL, 2);
+    co_pipeline_stage(p, "sum", stage_sum, &sum, 2);
+    assert(co_pipeline_start(p) == 0);
+    for (intptr_t i = 1; i <= 1000; ++i)
+        co_pipeline_push(p, (void *)i);
+    co_pipeline_finish(p);
+    // 1..1000 中 3 的倍数之和的两倍
+    printf("sum = %ld", sum);
+    assert(sum == 333666);
+}
+
+// -----------------------------------------------
+
+static void batch_producer(void *arg)
+{
+    struct chan *ch = arg;
+    void *items[10];
+    for (intptr_t i = 1; i <= 1000; i += 10) {
+        for (int j = 0; j < 10; ++j)
+            items[j] = (void *)(i + j);
+        for (int sent = 0; sent < 10;)
+            sent += chan_send_n(ch, items + sent, 10 - sent);
+    }
+    chan_close(ch);
+}
+
+static void test_16()
+{
+    for (int cap = 0; cap <= 16; cap += 16) {
+        struct chan *ch = chan_new(cap);
+        struct co *producer = co_start("producer", batch_producer, ch);
+        void *items[32];
+        intptr_t expect = 1;
+        int n;
+        while ((n = chan_recv_n(ch, items, 32)) > 0) {
+            for (int i = 0; i < n; ++i)
+                assert((intptr_t)items[i] == expect++);
+        }
+        assert(n == -1 && expect == 1001);
+        co_wait(producer);
+        chan_free(ch);
+        printf("cap %d ok  ", cap);
+    }
+}
+
+// -----------------------------------------------
+
+struct add_job {
+    long *total;
+    int value;
+};
+
+static void add_job(void *args)
+{
+    struct add_job *job = args;
+    if (job->value % 10 == 0)
+        co_sleep(1000000); // 任务可以挂起, 其他 worker 继续
+    *job->total += job->value;
+}
+
+static void test_17()
+{
+    struct co_sched_stats before, after;
+    long total = 0;
+
+    co_workers_t *pool = co_workers_new("worker", 4, 8);
+    co_sched_get_stats(co_sched_self(), &before);
+    for (int i = 1; i <= 1000; ++i) {
+        struct add_job job = { &total, i };
+        assert(co_workers_submit_args(pool, add_job, &job) == 0);
+    }
+    co_workers_free(pool);
+    co_sched_get_stats(co_sched_self(), &after);
+    printf("total = %ld", total);
+    assert(total == 500500);
+    assert(after.spawned == before.spawned);
+}
+
+// -----------------------------------------------
+
+static int g_admitted, g_max_running, g_admitted_sum;
+
+static void tracked(void *arg)
+{
+    if (++g_admitted > g_max_running)
+        g_max_running = g_admitted;
+    co_sleep(1000000);
+    g_admitted--;
+}
+
+static void tracked_args(void *arg)
+{
+    tracked(NULL);
+    g_admitted_sum += *(int *)arg;
+}
+
+// 创建者在 CO_LIMIT_BLOCK 的组上阻塞时被 co_post, 仍然要等到放行
+static struct co *g_blocked_spawner;
+static int g_poster_done;
+
+static void post_spawner(void *arg)
+{
+    co_sleep(500000);
+    co_post(co_sched_self(), g_blocked_spawner);
+    co_sleep(1000000);
+    g_poster_done = 1;
+}
+
+static void test_18()
+{
+    struct co *cos[20];
+    co_group_t fail, queue, block, nested;
+
+    co_group_init(&fail, NULL, 2, CO_LIMIT_FAIL);
+    cos[0] = co_group_start(&fail, "fail", tracked, NULL);
+    cos[1] = co_group_start(&fail, "fail", tracked, NULL);
+    assert(cos[0] && cos[1]);
+    assert(co_group_start(&fail, "fail", tracked, NULL) == NULL && errno == EAGAIN);
+    co_wait_all(cos, 2);
+    assert(fail.live == 0);
+
+    // 排队: 创建者不挂起, 同时运行的不超过 3 个
+    g_max_running = 0;
+    co_group_init(&queue, NULL, 3, CO_LIMIT_QUEUE);
+    for (int i = 0; i < 10; ++i)
+        cos[i] = co_group_start(&queue, "queue", tracked, NULL);
+    assert(queue.live == 3);
+    co_wait_all(cos, 10);
+    assert(g_max_running == 3);
+
+    // 阻塞创建者; 子组还受父组的限制
+    g_max_running = 0;
+    co_group_init(&block, NULL, 4, CO_LIMIT_BLOCK);
+    co_group_init(&nested, &block, 8, CO_LIMIT_BLOCK);
+    for (int i = 0; i < 10; ++i) {
+        cos[i] = co_group_start(i % 2 ? &nested : &block, "block", tracked, NULL);
+        assert(block.live <= 4);
+    }
+    co_wait_all(cos, 10);
+    assert(g_max_running == 4);
+
+    co_group_t one;
+    co_group_init(&one, NULL, 1, CO_LIMIT_BLOCK);
+    g_blocked_spawner = co_self();
+    cos[0] = co_group_start(&one, "post", post_spawner, NULL);
+    cos[1] = co_group_start(&one, "block", tracked, NULL);
+    assert(g_poster_done == 1);
+    co_wait_all(cos, 2);
+
+    // co_start_with: 排队的协程的参数放在堆上, 放行后照样能读到
+    g_max_running = 0;
+    co_sched_set_limit(co_sched_self(), 2, CO_LIMIT_QUEUE);
+    for (int i = 0; i < 6; ++i)
+        cos[i] = co_start_args("args", tracked_args, &i);
+    co_wait_all(cos, 6);
+    co_sched_set_limit(co_sched_self(), 0, CO_LIMIT_BLOCK);
+    assert(g_max_running == 2 && g_admitted_sum == 15);
+
+    // 调度器级别的限制
+    co_sched_t *s = co_sched_create();
+    g_max_running = 0;
+    co_sched_set_limit(s, 5, CO_LIMIT_QUEUE);
+    for (int i = 0; i < 20; ++i)
+        co_sched_start(s, "limited", tracked, NULL);
+    co_sched_run(s);
+    co_sched_destroy(s);
+    printf("max running = %d", g_max_running);
+    assert(g_max_running == 5);
+}
+
+// -----------------------------------------------
+
+static struct co_ratelimit g_rl;
+static int g_granted;
+
+static void throttled(void *arg)
+{
+    for (int i = 0; i < 10; ++i) {
+        co_ratelimit_acquire(&g_rl, 1);
+        g_granted++;
+    }
+}
+
+static void test_19()
+{
+    const uint64_t ms = 1000000;
+    struct co *cos[5];
+
+    // 每秒 1000 个, 最多攒 10 个: 50 个令牌约需 40ms
+    co_ratelimit_init(&g_rl, 1000, 10);
+    uint64_t start = co_now();
+    for (int i = 0; i < 5; ++i)
+        cos[i] = co_start("throttled", throttled, NULL);
+    co_wait_all(cos, 5);
+    uint64_t elapsed = co_now() - start;
+    printf("granted = %d", g_granted);
+    assert(g_granted == 50);
+    assert(elapsed >= 38 * ms);
+
+    // 先取空桶: 上面结束之后可能又攒了几个令牌 (机器忙时)
+    while (co_ratelimit_try_acquire(&g_rl, 1) == 0)
+        ;
+    assert(co_ratelimit_try_acquire(&g_rl, 5) == -1);
+    assert(co_ratelimit_acquire_until(&g_rl, 10, co_now() + ms) == CO_TIMEDOUT);
+    assert(co_ratelimit_acquire_until(&g_rl, 10, co_now() + 100 * ms) == 0);
+}
+
+// -----------------------------------------------
+
+static int g_last_runner, g_turns;
+static long g_iterations;
+
+// 忙循环 10ms, 每次迭代都 co_maybe_yield
+static void busy_loop(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    uint64_t start = co_now();
+    while (co_now() - start < 10 * 1000000) {
+        if (g_last_runner != id) {
+            g_last_runner = id;
+            g_turns++;
+        }
+        g_iterations++;
+        co_maybe_yield();
+    }
+}
+
+static void test_20()
+{
+    struct co_sched_stats before, after;
+    struct co *cos[2];
+
+    // 没有别人可以运行时不切换
+    co_sched_get_stats(co_sched_self(), &before);
+    for (int i = 0; i < 100000; ++i)
+        co_maybe_yield();
+    co_sched_get_stats(co_sched_self(), &after);
+    assert(after.switches == before.switches);
+
+    // 两个忙循环轮流运行, 但切换次数远少于迭代次数
+    co_sched_get_stats(co_sched_self(), &before);
+    cos[0] = co_start("busy", busy_loop, (void *)1);
+    cos[1] = co_start("busy", busy_loop, (void *)2);
+    co_wait_all(cos, 2);
+    co_sched_get_stats(co_sched_self(), &after);
+    assert(g_turns > 2);
+    assert(after.switches - before.switches < (uint64_t)g_iterations / 100);
+    printf("interleaved");
+}
+
+// -----------------------------------------------
+
+static int g_woke;
+
+static void wake_later(void *arg)
+{
+    co_sleep(2 * 1000000);
+    g_woke = 1;
+}
+
+static void test_21()
+{
+    struct co_sched_stats before, after;
+    long spins = 0;
+
+    // 只有自己就绪时 co_yield 不切换, 但定时器到期后仍然会让出去
+    struct co *co = co_start("wake", wake_later, NULL);
+    co_sched_get_stats(co_sched_self(), &before);
+    while (!g_woke) {
+        co_yield ();
+        spins++;
+    }
+    co_sched_get_stats(co_sched_self(), &after);
+    co_wait(co);
+    assert(spins > 100 && after.switches - before.switches <= 2);
+    printf("woke");
+}
+
+// fd 已经可读: 一直 co_yield 的协程也不能让 I/O 等待者饿死
+static int g_io_woke;
+
+static void wake_on_io(void *arg)
+{
+    assert(co_wait_io(*(int *)arg, POLLIN) & POLLIN);
+    g_io_woke = 1;
+}
+
+static void test_22()
+{
+    int fds[2];
+    long spins = 0;
+
+    assert(pipe(fds) == 0);
+    assert(write(fds[1], "x", 1) == 1);
+    struct co *co = co_start("io", wake_on_io, &fds[0]);
+    while (!g_io_woke && spins < 1000000) {
+        co_yield ();
+        spins++;
+    }
+    co_wait(co);
+    assert(g_io_woke && spins <= 2 * 64);
+    close(fds[0]);
+    close(fds[1]);
+    printf("io woke");
+}
+
 int main()
 {
     setbuf(stdout, NULL);
@@ -139,6 +1218,66 @@ int main()
     printf("\n\nTest #2. Expect: (libco-){200, 201, 202, ..., 399}\n");
     test_2();
 
+    printf("\n\nTest #3. Expect: sum = 20100  pipe ok\n");
+    test_3();
+
+    printf("\n\nTest #4. Expect: ids ok\n");
+    test_4();
+
+    printf("\n\nTest #5. Expect: isolated schedulers\n");
+    test_5();
+
+    printf("\n\nTest #6. Expect: loop done\n");
+    test_6();
+
+    printf("\n\nTest #7. Expect: sum = 204\n");
+    test_7();
+
+    printf("\n\nTest #8. Expect: fib(20) = 6765\n");
+    test_8();
+
+    printf("\n\nTest #9. Expect: 10 20 30 40\n");
+    test_9();
+
+    printf("\n\nTest #10. Expect: timeouts ok\n");
+    test_10();
+
+    printf("\n\nTest #11. Expect: 6765 6765 6765 sorted\n");
+    test_11();
+
+    printf("\n\nTest #12. Expect: 332833500 332833500\n");
+    test_12();
+
+    printf("\n\nTest #13. Expect: 21 21 42\n");
+    test_13();
+
+    printf("\n\nTest #14. Expect: total = 5050\n");
+    test_14();
+
+    printf("\n\nTest #15. Expect: sum = 333666\n");
+    test_15();
+
+    printf("\n\nTest #16. Expect: cap 0 ok  cap 16 ok\n");
+    test_16();
+
+    printf("\n\nTest #17. Expect: total = 500500\n");
+    test_17();
+
+    printf("\n\nTest #18. Expect: max running = 5\n");
+    test_18();
+
+    printf("\n\nTest #19. Expect: granted = 50\n");
+    test_19();
+
+    printf("\n\nTest #20. Expect: interleaved\n");
+    test_20();
+
+    printf("\n\nTest #21. Expect: woke\n");
+    test_21();
+
+    printf("\n\nTest #22. Expect: io woke\n");
+    test_22();
+
     printf("\n\n");
 
     return 0;
@@ -0,0 +1,257 @@
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <co.hpp>
+
+static int g_count = 0;
+
+static void test_1()
+{
+    // 捕获的 std::string 直接构造在协程栈上, 不需要 new 参数结构体
+    std::string x = "X", y = "Y";
+    co::task thd1("thread-1", [x] {
+        for (int i = 0; i < 100; ++i) {
+            printf("%s%d  ", x.c_str(), g_count++);
+            co::yield();
+        }
+    });
+    co::task thd2("thread-2", [y] {
+        for (int i = 0; i < 100; ++i) {
+            printf("%s%d  ", y.c_str(), g_count++);
+            co::yield();
+        }
+    });
+    // 析构时 join
+}
+
+static void test_2()
+{
+    int sum = 0;
+    std::vector<co::task> tasks;
+    for (int i = 1; i <= 10; ++i)
+        tasks.emplace_back("adder", [&sum, i] { sum += i; co::yield(); sum += i; });
+
+    co::task moved = std::move(tasks.back());
+    tasks.pop_back();
+    assert(moved.joinable());
+    moved.join();
+    assert(!moved.joinable());
+
+    tasks.clear();
+    printf("sum = %d", sum);
+    assert(sum == 110);
+}
+
+// -----------------------------------------------
+
+static co::async<int> add_later(int a, int b)
+{
+    co_await co::sleep_for(1000000);
+    co_return a + b;
+}
+
+static co::async<void> pipe_reader(int fd, int *out)
+{
+    int revents = co_await co::wait_io(fd, POLLIN);
+    assert(revents & POLLIN);
+    char c;
+    assert(read(fd, &c, 1) == 1);
+    *out = c;
+}
+
+static co::async<void> summer(co::chan *ch, int *sum, co::task *worker)
+{
+    // 无栈协程从通道接收有栈协程发来的数据, 最后等它结束
+    while (auto item = co_await co::recv(ch))
+        *sum += (int)(intptr_t)*item;
+    co_await co::join(*worker);
+    *sum += co_await add_later(1, 2);
+}
+
+static co::async<void> join_then_start(co::task *t, co::task *next, int *out)
+{
+    // t 结束时在它自己的栈上恢复这里, 并回收 t; 新协程不能拿到这块还在用的栈
+    co_await co::join(*t);
+    *next = co::task("next", [out] { *out = 7; });
+}
+
+static void test_3()
+{
+    // 有栈协程等待无栈协程
+    co::task t1("awaiter", [] {
+        int v = co::await(add_later(20, 22));
+        printf("add_later = %d  ", v);
+        assert(v == 42);
+    });
+    t1.join();
+
+    // 无栈协程等待 I/O, 由有栈协程写入
+    int fds[2], got = 0;
+    assert(pipe(fds) == 0);
+    co::spawn(pipe_reader(fds[0], &got));
+    co::task t2("writer", [&] {
+        co::co_sleep(1000000);
+        assert(write(fds[1], "y", 1) == 1);
+    });
+    t2.join();
+    co::await(co::sleep_for(1000000));
+    assert(got == 'y');
+    close(fds[0]);
+    close(fds[1]);
+
+    // 无栈协程消费有栈协程的通道
+    co::chan *ch = co::chan_new(0);
+    int sum = 0;
+    co::task producer("producer", [ch] {
+        for (int i = 1; i <= 100; ++i)
+            co::chan_send(ch, (void *)(intptr_t)i);
+        co::chan_close(ch);
+    });
+    co::await(summer(ch, &sum, &producer));
+    co::chan_free(ch);
+    printf("sum = %d", sum);
+    assert(sum == 5053);
+
+    // 在已结束的协程的栈上回收它, 紧接着创建新协程
+    int out = 0;
+    co::task next, last("last", [] { co::co_sleep(1000000); });
+    co::await(join_then_start(&last, &next, &out));
+    next.join();
+    assert(out == 7);
+}
+
+// -----------------------------------------------
+
+static co::async<void> async_consumer(co::channel<int, 0> &ch, int *sum)
+{
+    while (auto v = co_await ch.async_recv())
+        *sum += *v;
+}
+
+static void test_4()
+{
+    // 与 main.c 的 test_2 相同的生产者/消费者, 但元素直接移动进通道的内联缓冲区
+    co::channel<std::unique_ptr<std::string>, 4> ch;
+    int consumed = 0;
+    {
+        auto produce = [&] {
+            for (int i = 0; i < 100; ++i) {
+                auto item = std::make_unique<std::string>("libco-" + std::to_string(g_count++));
+                printf("%s  ", item->c_str());
+                ch.send(std::move(item));
+            }
+        };
+        auto consume = [&] {
+            while (auto item = ch.recv()) {
+                printf("%s  ", (*item)->c_str());
+                consumed++;
+            }
+        };
+        co::task thd3("consumer-1", consume);
+        co::task thd4("consumer-2", consume);
+        {
+            co::task thd1("producer-1", produce);
+            co::task thd2("producer-2", produce);
+        }
+        ch.close();
+    }
+    assert(consumed == 200);
+
+    // 同步通道, 由无栈协程接收
+    co::channel<int, 0> sync;
+    int sum = 0;
+    co::spawn(async_consumer(sync, &sum));
+    for (int i = 1; i <= 100; ++i)
+        sync.send(i);
+    sync.close();
+    co::await(co::reschedule());
+    printf("sum = %d", sum);
+    assert(sum == 5050);
+
+    // 超时
+    co::channel<int, 0> idle;
+    assert(!idle.recv(co::co_now() + 1000000));
+    assert(!idle.send(1, co::co_now() + 1000000));
+}
+
+// -----------------------------------------------
+
+struct counted {
+    int *drops;
+    explicit counted(int *d) : drops(d) {}
+    counted(const counted &o) : drops(o.drops) {}
+    ~counted() { ++*drops; }
+};
+
+static int g_drops = 0;
+alignas(co::task) static unsigned char g_queued[sizeof(co::task)];
+
+static void spawn_queued(void *arg)
+{
+    // 调度器只放行一个 (就是自己), 新协程排队; 句柄故意不析构, 否则会 join
+    int copies = g_drops;
+    new (g_queued) co::task("queued", [c = counted(&g_drops)] { assert(0); });
+    copies = g_drops - copies; // 构造过程中的临时对象
+    *(int *)arg = copies;
+    co::co_park();
+}
+
+static void test_5()
+{
+    co::co_sched_t *s = co::co_sched_create();
+    int temporaries = 0;
+    co::co_sched_set_limit(s, 1, co::CO_LIMIT_QUEUE);
+    co::co_sched_start(s, "spawner", spawn_queued, &temporaries);
+    assert(co::co_sched_run_once(s, 1000000000) == 0);
+    co::co_sched_destroy(s);
+    // 排队的协程没有运行过, 捕获的对象随调度器一起析构
+    printf("drops = %d", g_drops - temporaries);
+    assert(g_drops - temporaries == 1);
+
+    // 已满的 CO_LIMIT_FAIL 调度器拒绝创建, 不是内存不足
+    co::co_sched_t *self = co::co_sched_self();
+    co::co_sched_set_inline(self, 1); // first 创建后不立即运行, 一直占着名额
+    co::co_sched_set_limit(self, 1, co::CO_LIMIT_FAIL);
+    co::task first("first", [] {});
+    try {
+        co::task second("second", [] {});
+        assert(0);
+    } catch (const std::system_error &e) {
+        assert(e.code().value() == EAGAIN);
+        printf("  refused");
+    }
+    co::co_sched_set_limit(self, 0, co::CO_LIMIT_BLOCK);
+    first.join();
+    co::co_sched_set_inline(self, 0);
+}
+
+int main()
+{
+    setbuf(stdout, NULL);
+
+    printf("Test #1. Expect: (X|Y){0, 1, 2, ..., 199}\n");
+    test_1();
+    assert(g_count == 200);
+
+    printf("\n\nTest #2. Expect: sum = 110\n");
+    test_2();
+
+    printf("\n\nTest #3. Expect: add_later = 42  sum = 5053\n");
+    test_3();
+
+    printf("\n\nTest #4. Expect: (libco-){200, 201, 202, ..., 399}  sum = 5050\n");
+    test_4();
+
+    printf("\n\nTest #5. Expect: drops = 1  refused\n");
+    test_5();
+
+    printf("\n\n");
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include "co.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct co_job {
+    void (*fn)(void *args);
+    _Alignas(16) uint8_t args[CO_JOB_ARGS];
+};
+
+// 挂起的 worker 或提交者
+struct pool_waiter {
+    struct co_list link;
+    struct co_node node;
+};
+
+struct co_workers {
+    int cap, head, num;        // 任务环
+    int closing;
+    struct co_list idle;       // 没有任务时挂起的 worker
+    struct co_list submitters; // 环满时挂起的提交者
+    int worker_num;
+    struct co **cos;
+    struct co_job ring[];
+};
+
+static void pool_wake(struct co_list *q)
+{
+    if (co_list_empty(q))
+        return;
+    struct pool_waiter *w = co_list_entry(q->next, struct pool_waiter, link);
+    co_list_del(&w->link);
+    co_ready(&w->node);
+}
+
+static void pool_park(struct co_list *q)
+{
+    struct pool_waiter w;
+    co_node_init(&w.node, NULL);
+    co_list_add_tail(&w.link, q);
+    co_park();
+    co_list_del(&w.link); // 正常被 pool_wake 摘下, 这里只是保险
+}
+
+static void pool_worker(void *arg)
+{
+    struct co_workers *p = arg;
+    struct co_job job;
+
+    for (;;) {
+        if (p->num > 0) {
+            // 先复制出来, 腾出槽位给等待的提交者
+            job = p->ring[p->head];
+            p->head = (p->head + 1) % p->cap;
+            p->num--;
+            pool_wake(&p->submitters);
+            job.fn(job.args);
+        } else if (p->closing) {
+            break;
+        } else {
+            pool_park(&p->idle);
+        }
+    }
+}
+
+co_workers_t *co_workers_new(const char *name, int workers, int cap)
+{
+    assert(workers > 0 && cap > 0);
+    struct co_workers *p = malloc(sizeof(struct co_workers) + cap * sizeof(struct co_job));
+    if (!p)
+        return NULL;
+    p->cap = cap;
+    p->head = p->num = 0;
+    p->closing = 0;
+    co_list_init(&p->idle);
+    co_list_init(&p->submitters);
+    p->worker_num = 0;
+    if (!(p->cos = malloc(workers * sizeof(struct co *)))) {
+        free(p);
+        return NULL;
+    }
+    for (; p->worker_num < workers; ++p->worker_num) {
+        if (!(p->cos[p->worker_num] = co_start(name, pool_worker, p))) {
+            co_workers_free(p);
+            return NULL;
+        }
+    }
+    return p;
+}
+
+int co_workers_try_submit(co_workers_t *p, void (*fn)(void *args), const void *args, size_t size)
+{
+    assert(size <= CO_JOB_ARGS);
+    if (p->closing || p->num == p->cap)
+        return -1;
+    struct co_job *job = &p->ring[(p->head + p->num++) % p->cap];
+    job->fn = fn;
+    if (size)
+        memcpy(job->args, args, size);
+    pool_wake(&p->idle);
+    return 0;
+}
+
+int co_workers_submit(co_workers_t *p, void (*fn)(void *args), const void *args, size_t size)
+{
+    while (co_workers_try_submit(p, fn, args, size) < 0) {
+        if (p->closing)
+            return -1;
+        pool_park(&p->submitters);
+    }
+    return 0;
+}
+
+void co_workers_free(co_workers_t *p)
+{
+    // 剩下的任务做完后 worker 自己退出
+    p->closing = 1;
+    while (!co_list_empty(&p->idle))
+        pool_wake(&p->idle);
+    while (!co_list_empty(&p->submitters))
+        pool_wake(&p->submitters);
+    for (int i = 0; i < p->worker_num; ++i)
+        co_wait(p->cos[i]);
+    free(p->cos);
+    free(p);
+}